@@ -0,0 +1,26 @@
+Import("env")
+import os
+
+# "pio run -t uploadicons" builds the icon atlas from tools/icons and writes it to the icons partition
+
+iconsdir = os.path.join(env.get("PROJECT_DIR"), "tools", "icons")
+atlas = os.path.join(env.subst("$BUILD_DIR"), "icons.bin")
+
+def icons_partition_offset():
+    with open(os.path.join(env.get("PROJECT_DIR"), env.GetProjectOption("board_build.partitions"))) as f:
+        for line in f:
+            columns = [column.strip() for column in line.split(",")]
+            if columns[0] == "icons":
+                return columns[3]
+    raise ValueError("no icons partition in partition table")
+
+env.AddCustomTarget(
+    name="uploadicons",
+    dependencies=None,
+    actions=[
+        'cd "%s" && "$PYTHONEXE" build_icon_atlas.py "%s"' % (iconsdir, atlas),
+        '"$PYTHONEXE" "$UPLOADER" --chip esp32 --port "$UPLOAD_PORT" --baud $UPLOAD_SPEED write_flash %s "%s"' % (icons_partition_offset(), atlas),
+    ],
+    title="Upload icon atlas",
+    description="Build the 4bpp icon atlas and write it to the icons partition",
+)
@@ -0,0 +1,99 @@
+#include "M5PanelArena.h"
+
+#define ARENA_ALIGNMENT 8
+
+M5PanelArena treeArena;
+
+void *M5PanelArena::allocate(size_t size)
+{
+    void *memory = tryAllocate(size);
+    if (memory == NULL)
+    {
+        // objects and containers of the tree cannot report failed allocations
+        log_e("M5PanelArena: out of memory for %d bytes, restarting", size);
+        abort();
+    }
+    return memory;
+}
+
+void *M5PanelArena::tryAllocate(size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    size_t header = (sizeof(Chunk) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    for (size_t i = 0; i < ARENA_SIZE_CLASSES; i++)
+    {
+        if (freeLists[i].size == size && freeLists[i].head != NULL)
+        {
+            void *memory = freeLists[i].head;
+            freeLists[i].head = *(void **)memory;
+            releasedBytes -= size;
+            return memory;
+        }
+    }
+
+    if (chunks == NULL || chunks->used + size > chunks->size)
+    {
+        size_t chunkSize = max((size_t)ARENA_CHUNK_SIZE, header + size);
+        Chunk *chunk = (Chunk *)ps_malloc(chunkSize);
+        if (chunk == NULL)
+        {
+            chunk = (Chunk *)malloc(chunkSize);
+        }
+        if (chunk == NULL)
+        {
+            log_d("M5PanelArena: out of memory for %d bytes", size);
+            return NULL;
+        }
+        chunk->previous = chunks;
+        chunk->size = chunkSize;
+        chunk->used = header;
+        chunks = chunk;
+    }
+
+    void *memory = (uint8_t *)chunks + chunks->used;
+    chunks->used += size;
+    allocatedBytes += size;
+    return memory;
+}
+
+void M5PanelArena::release(void *memory, size_t size)
+{
+    if (memory == NULL)
+    {
+        return;
+    }
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    releasedBytes += size;
+
+    // keep for reuse if the size has a free list or a list is unused, else it is lost until reset
+    for (size_t i = 0; i < ARENA_SIZE_CLASSES; i++)
+    {
+        if (freeLists[i].size == size || freeLists[i].head == NULL)
+        {
+            freeLists[i].size = size;
+            *(void **)memory = freeLists[i].head;
+            freeLists[i].head = memory;
+            return;
+        }
+    }
+}
+
+void M5PanelArena::reset()
+{
+    log_d("M5PanelArena: releasing %d bytes (%d of them deleted before)", allocatedBytes, releasedBytes);
+    while (chunks != NULL)
+    {
+        Chunk *previous = chunks->previous;
+        free(chunks);
+        chunks = previous;
+    }
+    allocatedBytes = 0;
+    releasedBytes = 0;
+    memset(freeLists, 0, sizeof(freeLists));
+}
+
+boolean M5PanelArena::fragmented()
+{
+    return releasedBytes * 2 > allocatedBytes;
+}
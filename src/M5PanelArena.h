@@ -0,0 +1,68 @@
+#pragma once
+
+#include <Arduino.h>
+
+// size of the PSRAM blocks the page tree is allocated from
+#define ARENA_CHUNK_SIZE (16 * 1024)
+// object sizes whose deleted objects are kept for reuse
+#define ARENA_SIZE_CLASSES 8
+
+/**
+ * Bump allocator for one generation of the page tree, backed by PSRAM blocks.
+ * Memory of single deletes (when reconciling or evicting pages) is reused for objects of the same size,
+ * everything is reclaimed at once when the generation is reset.
+ */
+class M5PanelArena
+{
+private:
+    struct Chunk
+    {
+        Chunk *previous;
+        size_t size;
+        size_t used;
+    };
+
+    struct FreeList
+    {
+        size_t size;
+        void *head;
+    };
+
+    Chunk *chunks = NULL;
+    FreeList freeLists[ARENA_SIZE_CLASSES] = {};
+    size_t allocatedBytes = 0;
+    size_t releasedBytes = 0;
+
+public:
+    /** never returns NULL, the panel restarts when PSRAM and heap are exhausted */
+    void *allocate(size_t size);
+    /** like allocate, but NULL when out of memory, for callers that can do without */
+    void *tryAllocate(size_t size);
+    /** give back memory of a deleted object for reuse by objects of the same size */
+    void release(void *memory, size_t size);
+    /** free all blocks, every object of the generation must be destroyed before */
+    void reset();
+    /** more than half of the allocated bytes belong to deleted objects and are not reused */
+    boolean fragmented();
+};
+
+extern M5PanelArena treeArena;
+
+/** allocator for containers of the page tree */
+template <typename T>
+struct M5PanelArenaAllocator
+{
+    typedef T value_type;
+
+    M5PanelArenaAllocator() = default;
+    template <typename U>
+    M5PanelArenaAllocator(const M5PanelArenaAllocator<U> &) {}
+
+    T *allocate(size_t n) { return (T *)treeArena.allocate(n * sizeof(T)); }
+    void deallocate(T *memory, size_t n) { treeArena.release(memory, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const M5PanelArenaAllocator<T> &, const M5PanelArenaAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const M5PanelArenaAllocator<T> &, const M5PanelArenaAllocator<U> &) { return false; }
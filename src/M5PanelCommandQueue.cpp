@@ -0,0 +1,315 @@
+#include "M5PanelCommandQueue.h"
+#include "M5PanelHttpConnection.h"
+#include <LittleFS.h>
+#include <ezTime.h>
+
+M5PanelCommandQueue commandQueue;
+
+void M5PanelCommandQueue::begin()
+{
+    commands = xQueueCreate(COMMAND_QUEUE_LENGTH, sizeof(M5PanelCommand));
+    results = xQueueCreate(COMMAND_QUEUE_LENGTH, sizeof(M5PanelCommandResult));
+    journalLock = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(commandLoop, "commandLoop", 4096, this, 1, NULL, 0);
+}
+
+void M5PanelCommandQueue::commandLoop(void *pvParameters)
+{
+    ((M5PanelCommandQueue *)pvParameters)->serve();
+}
+
+void M5PanelCommandQueue::serve()
+{
+    // commands of the last wake that could not be sent
+    loadJournal();
+
+    M5PanelCommand command;
+    while (true)
+    {
+        TickType_t wait = queueSettled();
+        if (journalSize > 0)
+        {
+            long untilRetry = (long)(retryMillis - millis());
+            wait = min(wait, untilRetry > 0 ? (TickType_t)(untilRetry / portTICK_PERIOD_MS + 1) : 0);
+        }
+
+        // the command leaves the queue after it is journaled, so idle always sees it in one of both
+        if (xQueuePeek(commands, &command, wait) == pdTRUE)
+        {
+            record(&command);
+            xQueueReceive(commands, &command, 0);
+            continue;
+        }
+        sendJournal();
+    }
+}
+
+void M5PanelCommandQueue::loadJournal()
+{
+    File file = LittleFS.open(COMMAND_JOURNAL_FILE);
+    if (!file)
+    {
+        return;
+    }
+    size_t read = file.read((uint8_t *)journal, sizeof(journal));
+    file.close();
+    journalSize = read / sizeof(JournalEntry);
+    savedSize = journalSize;
+    log_d("loadJournal: %d commands to replay", journalSize);
+}
+
+void M5PanelCommandQueue::saveJournal()
+{
+    xSemaphoreTake(journalLock, portMAX_DELAY);
+    File file = LittleFS.open(COMMAND_JOURNAL_FILE, "w", true);
+    if (!file)
+    {
+        log_d("saveJournal: could not open %s", COMMAND_JOURNAL_FILE);
+        xSemaphoreGive(journalLock);
+        return;
+    }
+    file.write((uint8_t *)journal, journalSize * sizeof(JournalEntry));
+    file.close();
+    journalSaved = true;
+    savedSize = journalSize;
+    xSemaphoreGive(journalLock);
+}
+
+void M5PanelCommandQueue::persist()
+{
+    if (!journalSaved)
+    {
+        saveJournal();
+    }
+}
+
+void M5PanelCommandQueue::record(M5PanelCommand *command)
+{
+    xSemaphoreTake(journalLock, portMAX_DELAY);
+    journalSaved = false;
+    uint32_t recorded = timeStatus() == timeNotSet ? 0 : UTC.now();
+    for (size_t i = 0; i < journalSize; i++)
+    {
+        if (strcmp(journal[i].command.link, command->link) == 0)
+        {
+            // only the last command to an item matters
+            log_d("record: %s supersedes %s", command->value, journal[i].command.value);
+            if (strcmp(journal[i].command.widgetId, command->widgetId) != 0)
+            {
+                // another widget of the item gets no result of its own, it shows the item state again
+                report(&journal[i].command, false, 0);
+            }
+            journal[i] = {recorded, *command};
+            xSemaphoreGive(journalLock);
+            return;
+        }
+    }
+    if (journalSize == COMMAND_JOURNAL_SIZE)
+    {
+        log_d("record: journal full, dropping %s", journal[0].command.value);
+        report(&journal[0].command, false, 0);
+        memmove(journal, journal + 1, (journalSize - 1) * sizeof(JournalEntry));
+        journalSize--;
+    }
+    journal[journalSize] = {recorded, *command};
+    journalSize++;
+    xSemaphoreGive(journalLock);
+}
+
+void M5PanelCommandQueue::removeFirst()
+{
+    xSemaphoreTake(journalLock, portMAX_DELAY);
+    memmove(journal, journal + 1, (journalSize - 1) * sizeof(JournalEntry));
+    journalSize--;
+    journalSaved = false;
+    xSemaphoreGive(journalLock);
+    // commands in the file that were sent must not be replayed after waking up
+    if (savedSize > 0)
+    {
+        saveJournal();
+    }
+}
+
+void M5PanelCommandQueue::sendJournal()
+{
+    if (journalSize == 0 || (long)(retryMillis - millis()) > 0)
+    {
+        return;
+    }
+
+    JournalEntry &entry = journal[0];
+    if (entry.recorded != 0 && timeStatus() == timeNotSet)
+    {
+        // the age of the command is not known before the time is synchronized
+        retryMillis = millis() + COMMAND_RETRY_MIN;
+        persist();
+        return;
+    }
+    if (entry.recorded != 0 && UTC.now() > entry.recorded + COMMAND_JOURNAL_MAX_AGE)
+    {
+        log_d("sendJournal: dropping outdated command %s", entry.command.value);
+        report(&entry.command, false, 0);
+        removeFirst();
+        return;
+    }
+
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        // replay soon after the connection is back
+        retryMillis = millis() + COMMAND_RETRY_MIN;
+        persist();
+        return;
+    }
+
+    log_d("Sending value %s", entry.command.value);
+    int httpCode = restConnection.POST(entry.command.link, "text/plain", entry.command.value);
+    restConnection.end();
+    if (httpCode < 0 || httpCode >= 500)
+    {
+        // network down or openHAB restarting, keep the command
+        log_d("sendJournal: sending %s failed with %d, retrying in %lu ms", entry.command.value, httpCode, retryDelay);
+        retryMillis = millis() + retryDelay;
+        retryDelay = min(retryDelay * 2, (unsigned long)COMMAND_RETRY_MAX);
+        persist();
+        return;
+    }
+
+    retryDelay = COMMAND_RETRY_MIN;
+    report(&entry.command, httpCode < 300, httpCode);
+    removeFirst();
+}
+
+void M5PanelCommandQueue::report(M5PanelCommand *command, boolean sent, int httpCode)
+{
+    if (!sent)
+    {
+        log_d("ERROR: command to %s failed with HTTP code %d", command->link, httpCode);
+    }
+    M5PanelCommandResult result;
+    strlcpy(result.widgetId, command->widgetId, sizeof(result.widgetId));
+    result.sent = sent;
+    result.httpCode = httpCode;
+    if (xQueueSend(results, &result, 0) != pdTRUE)
+    {
+        log_d("report: result queue full, dropping result of %s", command->widgetId);
+    }
+}
+
+TickType_t M5PanelCommandQueue::queueSettled()
+{
+    // without settling values, sendSettled is noticed after at most COMMAND_SETTLE_TIME, which is when it settles
+    unsigned long wait = COMMAND_SETTLE_TIME;
+    M5PanelCommand settled[COMMAND_SETTLING_SLOTS];
+    size_t numSettled = 0;
+    unsigned long now = millis();
+    portENTER_CRITICAL(&settlingLock);
+    for (Settling &slot : settling)
+    {
+        if (!slot.used)
+        {
+            continue;
+        }
+        if ((long)(slot.dueMillis - now) > 0)
+        {
+            wait = min(wait, slot.dueMillis - now);
+            continue;
+        }
+        settled[numSettled++] = slot.command;
+        slot.used = false;
+    }
+    portEXIT_CRITICAL(&settlingLock);
+
+    // queue functions must not be called within the critical section
+    for (size_t i = 0; i < numSettled; i++)
+    {
+        if (xQueueSend(commands, &settled[i], 0) != pdTRUE)
+        {
+            log_d("queueSettled: command queue full, dropping %s", settled[i].value);
+            report(&settled[i], false, 0);
+        }
+    }
+    return wait / portTICK_PERIOD_MS + 1;
+}
+
+boolean M5PanelCommandQueue::fillCommand(M5PanelCommand *command, String widgetId, String link, String value)
+{
+    if (link.length() >= COMMAND_LINK_SIZE || value.length() >= COMMAND_VALUE_SIZE)
+    {
+        log_d("send: command to %s too long", link.c_str());
+        return false;
+    }
+    strlcpy(command->widgetId, widgetId.c_str(), sizeof(command->widgetId));
+    strlcpy(command->link, link.c_str(), sizeof(command->link));
+    strlcpy(command->value, value.c_str(), sizeof(command->value));
+    return true;
+}
+
+boolean M5PanelCommandQueue::send(String widgetId, String link, String value)
+{
+    M5PanelCommand command;
+    if (!fillCommand(&command, widgetId, link, value))
+    {
+        return false;
+    }
+    if (xQueueSend(commands, &command, 0) != pdTRUE)
+    {
+        log_d("send: command queue full, rejecting %s", value.c_str());
+        return false;
+    }
+    return true;
+}
+
+boolean M5PanelCommandQueue::sendSettled(String widgetId, String link, String value)
+{
+    M5PanelCommand command;
+    if (!fillCommand(&command, widgetId, link, value))
+    {
+        return false;
+    }
+
+    Settling *target = NULL;
+    portENTER_CRITICAL(&settlingLock);
+    for (Settling &slot : settling)
+    {
+        if (slot.used && strcmp(slot.command.widgetId, command.widgetId) == 0)
+        {
+            // supersede the value of the previous taps
+            target = &slot;
+            break;
+        }
+        if (!slot.used && target == NULL)
+        {
+            target = &slot;
+        }
+    }
+    if (target != NULL)
+    {
+        target->used = true;
+        target->dueMillis = millis() + COMMAND_SETTLE_TIME;
+        target->command = command;
+    }
+    portEXIT_CRITICAL(&settlingLock);
+
+    if (target == NULL)
+    {
+        log_d("sendSettled: no free slot, rejecting %s", value.c_str());
+    }
+    return target != NULL;
+}
+
+boolean M5PanelCommandQueue::nextResult(M5PanelCommandResult *result)
+{
+    return xQueueReceive(results, result, 0) == pdTRUE;
+}
+
+boolean M5PanelCommandQueue::idle()
+{
+    boolean settled = true;
+    portENTER_CRITICAL(&settlingLock);
+    for (Settling &slot : settling)
+    {
+        settled &= !slot.used;
+    }
+    portEXIT_CRITICAL(&settlingLock);
+    return settled && uxQueueMessagesWaiting(commands) == 0 && journalSize == 0;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <Arduino.h>
+#include "defs.h"
+
+// commands waiting to be sent, touches beyond that are rejected
+#ifndef COMMAND_QUEUE_LENGTH
+#define COMMAND_QUEUE_LENGTH 8
+#endif
+
+// time without further taps after which a setpoint value is sent (ms)
+#ifndef COMMAND_SETTLE_TIME
+#define COMMAND_SETTLE_TIME 800
+#endif
+
+// widgets that can have a value waiting to settle at the same time
+#define COMMAND_SETTLING_SLOTS 4
+
+// commands not sent yet, written when sending fails and before deep sleep, replayed after waking up
+#define COMMAND_JOURNAL_FILE "/commandJournal"
+#ifndef COMMAND_JOURNAL_SIZE
+#define COMMAND_JOURNAL_SIZE 16
+#endif
+
+// age after which a journaled command is dropped instead of sent (s)
+#ifndef COMMAND_JOURNAL_MAX_AGE
+#define COMMAND_JOURNAL_MAX_AGE 600
+#endif
+
+// wait before sending again after a failed attempt, doubled up to COMMAND_RETRY_MAX (ms)
+#define COMMAND_RETRY_MIN 1000
+#define COMMAND_RETRY_MAX 60000
+
+#define COMMAND_WIDGET_ID_SIZE 64
+#define COMMAND_LINK_SIZE 192
+#define COMMAND_VALUE_SIZE 64
+
+/** item command as queued, fixed size because queue items are copied bytewise */
+struct M5PanelCommand
+{
+    char widgetId[COMMAND_WIDGET_ID_SIZE];
+    char link[COMMAND_LINK_SIZE];
+    char value[COMMAND_VALUE_SIZE];
+};
+
+/** outcome of a sent command, for rolling back what the touch showed if it failed */
+struct M5PanelCommandResult
+{
+    char widgetId[COMMAND_WIDGET_ID_SIZE];
+    boolean sent;
+    int httpCode;
+};
+
+/**
+ * Sends item commands from a task of its own, so that touch handling returns without waiting for the network.
+ * Commands are journaled until they are sent and retried while the network or openHAB is unavailable;
+ * the journal goes to LittleFS only when a command could not be sent or before deep sleep, and is replayed after waking up.
+ * Results are collected by the update loop.
+ */
+class M5PanelCommandQueue
+{
+private:
+    QueueHandle_t commands = NULL;
+    QueueHandle_t results = NULL;
+
+    /** values waiting for their widget's taps to settle, guarded by settlingLock */
+    struct Settling
+    {
+        boolean used;
+        unsigned long dueMillis;
+        M5PanelCommand command;
+    };
+    Settling settling[COMMAND_SETTLING_SLOTS] = {};
+    portMUX_TYPE settlingLock = portMUX_INITIALIZER_UNLOCKED;
+
+    /** command waiting to be sent, with the UTC time it was given (0 if the time was not known) */
+    struct JournalEntry
+    {
+        uint32_t recorded;
+        M5PanelCommand command;
+    };
+    /** oldest entry first, changed by the command task only and guarded by journalLock */
+    JournalEntry journal[COMMAND_JOURNAL_SIZE];
+    volatile size_t journalSize = 0;
+    SemaphoreHandle_t journalLock = NULL;
+    /** the journal file has the entries of journal */
+    boolean journalSaved = true;
+    /** entries in the journal file, which has to be rewritten once they are sent */
+    size_t savedSize = 0;
+    unsigned long retryMillis = 0;
+    unsigned long retryDelay = COMMAND_RETRY_MIN;
+
+    static void commandLoop(void *pvParameters);
+    void serve();
+    void loadJournal();
+    void saveJournal();
+    /** add a command to the journal, replacing a command to the same item that was not sent yet */
+    void record(M5PanelCommand *command);
+    void removeFirst();
+    /** send the oldest journaled command if no retry is waiting */
+    void sendJournal();
+    void report(M5PanelCommand *command, boolean sent, int httpCode);
+    /** queue the settled values, returns the time until the next one settles */
+    TickType_t queueSettled();
+    static boolean fillCommand(M5PanelCommand *command, String widgetId, String link, String value);
+
+public:
+    /** create the queues and start the command task */
+    void begin();
+
+    /** queue a command to the item link of a widget, false if the queue is full */
+    boolean send(String widgetId, String link, String value);
+
+    /**
+     * queue a command once no further value was given for the widget for COMMAND_SETTLE_TIME,
+     * replacing its value that did not settle yet; false if no slot is free
+     */
+    boolean sendSettled(String widgetId, String link, String value);
+
+    /** next result of a sent command, false if there is none */
+    boolean nextResult(M5PanelCommandResult *result);
+
+    /** true if no command is settling, waiting or being sent; journaled commands count as waiting */
+    boolean idle();
+
+    /** write the commands not sent yet to the journal file, before going to sleep */
+    void persist();
+};
+
+extern M5PanelCommandQueue commandQueue;
@@ -0,0 +1,293 @@
+#include "M5PanelGlyphCache.h"
+#include <LittleFS.h>
+#include <vector>
+
+#define GLYPH_CACHE_MAGIC "M5GC"
+
+M5PanelGlyphCache glyphCache;
+
+static uint32_t glyphKey(uint8_t size, uint32_t codepoint)
+{
+    return (uint32_t)size << 24 | (codepoint & 0xFFFFFF);
+}
+
+static size_t coverageSize(uint16_t width, uint16_t height)
+{
+    return (width + 1) / 2 * height;
+}
+
+M5PanelGlyphCache::M5PanelGlyphCache() : rasterCanvas(&M5.EPD)
+{
+    lock = xSemaphoreCreateMutex();
+}
+
+void M5PanelGlyphCache::begin()
+{
+    File font = LittleFS.open(FONT_FILE, FILE_READ);
+    if (font)
+    {
+        fontFileSize = font.size();
+        font.close();
+    }
+
+    File file = LittleFS.open(GLYPH_CACHE_FILE, FILE_READ);
+    if (file)
+    {
+        char magic[4];
+        uint16_t version = 0;
+        uint32_t cachedFontFileSize = 0;
+        boolean valid = file.read((uint8_t *)magic, 4) == 4 && memcmp(magic, GLYPH_CACHE_MAGIC, 4) == 0 && file.read((uint8_t *)&version, sizeof(version)) == sizeof(version) && version == GLYPH_CACHE_VERSION && file.read((uint8_t *)&cachedFontFileSize, sizeof(cachedFontFileSize)) == sizeof(cachedFontFileSize) && cachedFontFileSize == fontFileSize;
+
+        while (valid && file.available())
+        {
+            uint8_t size;
+            uint32_t codepoint;
+            Glyph glyph;
+            if (file.read(&size, 1) != 1 || file.read((uint8_t *)&codepoint, sizeof(codepoint)) != sizeof(codepoint) || file.read((uint8_t *)&glyph.advance, sizeof(glyph.advance)) != sizeof(glyph.advance) || file.read((uint8_t *)&glyph.width, sizeof(glyph.width)) != sizeof(glyph.width) || file.read((uint8_t *)&glyph.height, sizeof(glyph.height)) != sizeof(glyph.height))
+            {
+                break; // truncated record, keep what was read so far
+            }
+            size_t bytes = coverageSize(glyph.width, glyph.height);
+            glyph.coverage = (uint8_t *)ps_malloc(bytes);
+            if (glyph.coverage == NULL || file.read(glyph.coverage, bytes) != bytes)
+            {
+                free(glyph.coverage);
+                break;
+            }
+            glyphs[glyphKey(size, codepoint)] = glyph;
+        }
+        file.close();
+
+        if (!valid)
+        {
+            log_d("M5PanelGlyphCache: dropping glyph cache of another font");
+            LittleFS.remove(GLYPH_CACHE_FILE);
+        }
+    }
+
+    if (!LittleFS.exists(GLYPH_CACHE_FILE))
+    {
+        File file = LittleFS.open(GLYPH_CACHE_FILE, FILE_WRITE);
+        uint16_t version = GLYPH_CACHE_VERSION;
+        file.write((const uint8_t *)GLYPH_CACHE_MAGIC, 4);
+        file.write((const uint8_t *)&version, sizeof(version));
+        file.write((const uint8_t *)&fontFileSize, sizeof(fontFileSize));
+        file.close();
+    }
+
+    log_d("M5PanelGlyphCache: %d glyphs loaded", glyphs.size());
+}
+
+uint32_t M5PanelGlyphCache::decodeUtf8(const char *text, size_t *position)
+{
+    uint8_t first = text[*position];
+    int continuationBytes = first >= 0xF0 ? 3 : first >= 0xE0 ? 2 : first >= 0xC0 ? 1 : 0;
+    uint32_t codepoint = continuationBytes == 0 ? first : first & (0x3F >> continuationBytes);
+    (*position)++;
+    for (int i = 0; i < continuationBytes && (text[*position] & 0xC0) == 0x80; i++)
+    {
+        codepoint = codepoint << 6 | (text[*position] & 0x3F);
+        (*position)++;
+    }
+    return codepoint;
+}
+
+M5PanelGlyphCache::Glyph M5PanelGlyphCache::rasterize(const char *character, size_t length, uint8_t size)
+{
+    if (!fontLoaded)
+    {
+        rasterCanvas.loadFont(FONT_FILE, LittleFS);
+        fontLoaded = true;
+    }
+    if (renderedSizes.find(size) == renderedSizes.end())
+    {
+        rasterCanvas.createRender(size, GLYPH_RENDER_CACHE_SIZE);
+        renderedSizes.insert(size);
+    }
+
+    String text = String(character).substring(0, length);
+    rasterCanvas.setTextSize(size);
+
+    Glyph glyph;
+    int padding = size / 4;
+    glyph.advance = rasterCanvas.textWidth(text);
+    glyph.width = glyph.advance + 2 * padding;
+    glyph.height = rasterCanvas.fontHeight();
+    glyph.coverage = (uint8_t *)ps_malloc(coverageSize(glyph.width, glyph.height));
+    if (glyph.coverage == NULL)
+    {
+        return glyph;
+    }
+
+    // the glyph drawn with 15 on the background 0 (white) gives the coverage of each pixel
+    rasterCanvas.createCanvas(glyph.width, glyph.height);
+    rasterCanvas.fillCanvas(0);
+    rasterCanvas.setTextColor(15);
+    rasterCanvas.setTextDatum(TL_DATUM);
+    rasterCanvas.drawString(text, padding, 0);
+
+    memset(glyph.coverage, 0, coverageSize(glyph.width, glyph.height));
+    int rowBytes = (glyph.width + 1) / 2;
+    for (int y = 0; y < glyph.height; y++)
+    {
+        for (int x = 0; x < glyph.width; x++)
+        {
+            uint8_t value = rasterCanvas.readPixel(x, y) & 0x0F;
+            glyph.coverage[y * rowBytes + x / 2] |= x % 2 == 0 ? value << 4 : value;
+        }
+    }
+    rasterCanvas.deleteCanvas();
+
+    rasterized++;
+    return glyph;
+}
+
+void M5PanelGlyphCache::persist(uint8_t size, uint32_t codepoint, const Glyph &glyph)
+{
+    File file = LittleFS.open(GLYPH_CACHE_FILE, FILE_APPEND);
+    if (!file)
+    {
+        return;
+    }
+    file.write(&size, 1);
+    file.write((const uint8_t *)&codepoint, sizeof(codepoint));
+    file.write((const uint8_t *)&glyph.advance, sizeof(glyph.advance));
+    file.write((const uint8_t *)&glyph.width, sizeof(glyph.width));
+    file.write((const uint8_t *)&glyph.height, sizeof(glyph.height));
+    file.write(glyph.coverage, coverageSize(glyph.width, glyph.height));
+    file.close();
+}
+
+const M5PanelGlyphCache::Glyph *M5PanelGlyphCache::getGlyph(const char *character, size_t length, uint32_t codepoint, uint8_t size)
+{
+    uint32_t key = glyphKey(size, codepoint);
+    auto cached = glyphs.find(key);
+    if (cached != glyphs.end())
+    {
+        return &cached->second;
+    }
+
+    log_d("M5PanelGlyphCache: rasterizing U+%04X at size %d", codepoint, size);
+    Glyph glyph = rasterize(character, length, size);
+    if (glyph.coverage == NULL)
+    {
+        return NULL;
+    }
+    persist(size, codepoint, glyph);
+    return &(glyphs[key] = glyph);
+}
+
+void M5PanelGlyphCache::drawGlyph(M5EPD_Canvas *canvas, const Glyph *glyph, int x, int y, uint8_t color)
+{
+    int padding = (glyph->width - glyph->advance) / 2;
+    int rowBytes = (glyph->width + 1) / 2;
+    for (int row = 0; row < glyph->height; row++)
+    {
+        for (int column = 0; column < glyph->width; column++)
+        {
+            uint8_t packed = glyph->coverage[row * rowBytes + column / 2];
+            uint8_t coverage = column % 2 == 0 ? packed >> 4 : packed & 0x0F;
+            if (coverage == 0)
+            {
+                continue;
+            }
+            int pixelX = x - padding + column;
+            int pixelY = y + row;
+            int background = canvas->readPixel(pixelX, pixelY) & 0x0F;
+            canvas->drawPixel(pixelX, pixelY, background + ((color - background) * coverage + (color > background ? 7 : -7)) / 15);
+        }
+    }
+}
+
+int M5PanelGlyphCache::textWidth(String text, uint8_t size)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int width = 0;
+    const char *characters = text.c_str();
+    size_t position = 0;
+    while (position < text.length())
+    {
+        size_t start = position;
+        uint32_t codepoint = decodeUtf8(characters, &position);
+        const Glyph *glyph = getGlyph(characters + start, position - start, codepoint, size);
+        width += glyph != NULL ? glyph->advance : 0;
+    }
+    xSemaphoreGive(lock);
+    return width;
+}
+
+void M5PanelGlyphCache::drawString(M5EPD_Canvas *canvas, String text, uint8_t size, uint8_t datum, int x, int y, uint8_t color)
+{
+    std::vector<const Glyph *> line;
+    int width = 0;
+    int height = 0;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    const char *characters = text.c_str();
+    size_t position = 0;
+    while (position < text.length())
+    {
+        size_t start = position;
+        uint32_t codepoint = decodeUtf8(characters, &position);
+        const Glyph *glyph = getGlyph(characters + start, position - start, codepoint, size);
+        if (glyph != NULL)
+        {
+            line.push_back(glyph);
+            width += glyph->advance;
+            height = max(height, (int)glyph->height);
+        }
+    }
+
+    // datums as in TFT_eSPI: column is left / center / right, row is top / middle / bottom
+    if (datum <= BR_DATUM)
+    {
+        x -= datum % 3 * width / 2;
+        y -= datum / 3 * height / 2;
+    }
+    else
+    {
+        x -= (datum - L_BASELINE) * width / 2;
+        y -= height;
+    }
+
+    for (const Glyph *glyph : line)
+    {
+        drawGlyph(canvas, glyph, x, y, color);
+        x += glyph->advance;
+    }
+    xSemaphoreGive(lock);
+}
+
+void M5PanelGlyphCache::drawWrapped(M5EPD_Canvas *canvas, String text, uint8_t size, int x, int y, int width, uint8_t color)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    const Glyph *space = getGlyph(" ", 1, ' ', size);
+    int lineHeight = space != NULL ? space->height : size;
+    xSemaphoreGive(lock);
+
+    String line = "";
+    int lineY = y;
+    int start = 0;
+    while (start <= (int)text.length())
+    {
+        int end = text.indexOf(' ', start);
+        if (end < 0)
+        {
+            end = text.length();
+        }
+        String word = text.substring(start, end);
+        String extended = line == "" ? word : line + " " + word;
+        if (line != "" && textWidth(extended, size) > width)
+        {
+            drawString(canvas, line, size, TL_DATUM, x, lineY, color);
+            lineY += lineHeight;
+            line = word;
+        }
+        else
+        {
+            line = extended;
+        }
+        start = end + 1;
+    }
+    drawString(canvas, line, size, TL_DATUM, x, lineY, color);
+}
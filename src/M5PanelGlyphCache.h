@@ -0,0 +1,59 @@
+#pragma once
+
+#include <M5EPD.h>
+#include <unordered_map>
+#include <set>
+
+#define FONT_FILE "/FreeSansBold.ttf"
+#define GLYPH_CACHE_FILE "/glyphCache"
+#define GLYPH_CACHE_VERSION 1
+// glyphs are rasterized once per size, the render cache of the font only serves rasterization
+#define GLYPH_RENDER_CACHE_SIZE 16
+
+/**
+ * Glyphs rasterized from the panel font, kept in PSRAM and persisted to flash.
+ * Rasterization happens once per glyph and size, across deep sleep and reboots.
+ * The cache is dropped when the font file changes.
+ */
+class M5PanelGlyphCache
+{
+private:
+    struct Glyph
+    {
+        uint16_t advance;
+        uint16_t width; // advance plus padding on both sides for overhanging pixels
+        uint16_t height;
+        uint8_t *coverage; // 4bpp, two pixels per byte
+    };
+
+    std::unordered_map<uint32_t, Glyph> glyphs;
+    std::set<uint8_t> renderedSizes;
+    uint32_t fontFileSize = 0;
+    boolean fontLoaded = false;
+    M5EPD_Canvas rasterCanvas;
+    SemaphoreHandle_t lock;
+
+    static uint32_t decodeUtf8(const char *text, size_t *position);
+    const Glyph *getGlyph(const char *character, size_t length, uint32_t codepoint, uint8_t size);
+    Glyph rasterize(const char *character, size_t length, uint8_t size);
+    void persist(uint8_t size, uint32_t codepoint, const Glyph &glyph);
+    void drawGlyph(M5EPD_Canvas *canvas, const Glyph *glyph, int x, int y, uint8_t color);
+
+public:
+    uint32_t rasterized = 0;
+
+    M5PanelGlyphCache();
+
+    /** load persisted glyphs, requires LittleFS to be mounted */
+    void begin();
+
+    int textWidth(String text, uint8_t size);
+
+    /** draw text like M5EPD_Canvas::drawString with the given size, datum and color */
+    void drawString(M5EPD_Canvas *canvas, String text, uint8_t size, uint8_t datum, int x, int y, uint8_t color = 15);
+
+    /** draw text from the top left of the area, wrapping lines at spaces */
+    void drawWrapped(M5EPD_Canvas *canvas, String text, uint8_t size, int x, int y, int width, uint8_t color = 15);
+};
+
+extern M5PanelGlyphCache glyphCache;
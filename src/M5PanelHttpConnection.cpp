@@ -0,0 +1,271 @@
+#include "M5PanelHttpConnection.h"
+
+// Response body
+
+void M5PanelHttpBodyStream::begin(Client *client, boolean chunked, int size)
+{
+    this->client = client;
+    this->chunked = chunked;
+    remaining = chunked ? 0 : size;
+    chunkState = chunked ? ChunkState::Size : ChunkState::Done;
+    trailerLineLength = 0;
+}
+
+boolean M5PanelHttpBodyStream::finished()
+{
+    if (client == NULL)
+    {
+        return true;
+    }
+    if (chunked)
+    {
+        return chunkState == ChunkState::Done;
+    }
+    if (remaining < 0)
+    {
+        // body ends when the server closes the connection
+        return !client->connected() && client->available() == 0;
+    }
+    return remaining == 0;
+}
+
+boolean M5PanelHttpBodyStream::advanceToChunkData()
+{
+    while (chunkState != ChunkState::Data && chunkState != ChunkState::Done && client->available() > 0)
+    {
+        char c = client->read();
+        switch (chunkState)
+        {
+        case ChunkState::Size:
+        case ChunkState::Extension:
+            if (c == '\n')
+            {
+                // a chunk of size 0 is followed by the trailer
+                chunkState = remaining == 0 ? ChunkState::Trailer : ChunkState::Data;
+            }
+            else if (chunkState == ChunkState::Size && isxdigit(c))
+            {
+                remaining = remaining * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+            }
+            else if (c != '\r')
+            {
+                chunkState = ChunkState::Extension;
+            }
+            break;
+        case ChunkState::DataEnd:
+            if (c == '\n')
+            {
+                chunkState = ChunkState::Size;
+                remaining = 0;
+            }
+            break;
+        case ChunkState::Trailer:
+            if (c == '\n')
+            {
+                if (trailerLineLength == 0)
+                {
+                    chunkState = ChunkState::Done;
+                }
+                trailerLineLength = 0;
+            }
+            else if (c != '\r')
+            {
+                trailerLineLength++;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return chunkState == ChunkState::Data;
+}
+
+int M5PanelHttpBodyStream::available()
+{
+    if (client == NULL)
+    {
+        return 0;
+    }
+    if (chunked)
+    {
+        return advanceToChunkData() ? min(client->available(), remaining) : 0;
+    }
+    return remaining < 0 ? client->available() : min(client->available(), remaining);
+}
+
+int M5PanelHttpBodyStream::read()
+{
+    if (client == NULL)
+    {
+        return -1;
+    }
+    if (chunked)
+    {
+        if (!advanceToChunkData())
+        {
+            return -1;
+        }
+        int c = client->read();
+        if (c >= 0 && --remaining == 0)
+        {
+            chunkState = ChunkState::DataEnd;
+        }
+        return c;
+    }
+    if (remaining == 0)
+    {
+        return -1;
+    }
+    int c = client->read();
+    if (c >= 0 && remaining > 0)
+    {
+        remaining--;
+    }
+    return c;
+}
+
+int M5PanelHttpBodyStream::peek()
+{
+    if (client == NULL || (chunked && !advanceToChunkData()) || remaining == 0)
+    {
+        return -1;
+    }
+    return client->peek();
+}
+
+boolean M5PanelHttpBodyStream::drain(unsigned long timeout)
+{
+    if (!chunked && remaining < 0)
+    {
+        // length unknown, connection can not be reused anyway
+        return true;
+    }
+    unsigned long start = millis();
+    while (!finished())
+    {
+        if (read() < 0)
+        {
+            if (millis() - start > timeout)
+            {
+                return false;
+            }
+            delay(1);
+        }
+    }
+    return true;
+}
+
+// Connection
+
+static const char *collectedHeaders[] = {"Transfer-Encoding"};
+
+static String getUrlHost(String &url)
+{
+    int hostStart = url.indexOf("://");
+    hostStart = hostStart < 0 ? 0 : hostStart + 3;
+    int hostEnd = url.indexOf('/', hostStart);
+    return hostEnd < 0 ? url.substring(hostStart) : url.substring(hostStart, hostEnd);
+}
+
+M5PanelHttpConnection::M5PanelHttpConnection()
+{
+    lock = xSemaphoreCreateMutex();
+    http.setReuse(true);
+    http.collectHeaders(collectedHeaders, 1);
+}
+
+int M5PanelHttpConnection::GET(String url)
+{
+    return request("GET", url, NULL, "");
+}
+
+int M5PanelHttpConnection::POST(String url, const char *contentType, String payload)
+{
+    return request("POST", url, contentType, payload);
+}
+
+int M5PanelHttpConnection::request(const char *method, String &url, const char *contentType, String payload)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    String host = getUrlHost(url);
+    if (host != connectedHost)
+    {
+        // kept connection leads to a different host
+        client.stop();
+        connectedHost = host;
+    }
+
+    int httpCode = 0;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        boolean reused = client.connected();
+        if (reused)
+        {
+            log_d("M5PanelHttpConnection: reusing connection to %s", host.c_str());
+        }
+
+        http.begin(client, url);
+        if (contentType != NULL)
+        {
+            http.addHeader(F("Content-Type"), contentType);
+        }
+        httpCode = http.sendRequest(method, payload);
+
+        boolean closedWhileIdle = httpCode == HTTPC_ERROR_SEND_HEADER_FAILED || httpCode == HTTPC_ERROR_SEND_PAYLOAD_FAILED || httpCode == HTTPC_ERROR_CONNECTION_LOST || httpCode == HTTPC_ERROR_NOT_CONNECTED;
+        if (!reused || !closedWhileIdle)
+        {
+            break;
+        }
+
+        // server closed the kept connection, retry once on a new one
+        log_d("M5PanelHttpConnection: kept connection lost (%d), reconnecting", httpCode);
+        http.end();
+        client.stop();
+    }
+
+    body.begin(&client, http.header("Transfer-Encoding").equalsIgnoreCase("chunked"), http.getSize());
+    return httpCode;
+}
+
+Stream &M5PanelHttpConnection::getStream()
+{
+    return body;
+}
+
+String M5PanelHttpConnection::getString()
+{
+    String response;
+    int size = http.getSize();
+    if (size > 0)
+    {
+        response.reserve(size);
+    }
+
+    unsigned long lastReceived = millis();
+    while (!body.finished() && millis() - lastReceived < HTTP_BODY_TIMEOUT)
+    {
+        int c = body.read();
+        if (c < 0)
+        {
+            delay(1);
+            continue;
+        }
+        response += (char)c;
+        lastReceived = millis();
+    }
+    return response;
+}
+
+void M5PanelHttpConnection::end()
+{
+    if (!body.drain(HTTP_BODY_TIMEOUT))
+    {
+        // incomplete response would corrupt the next one
+        client.stop();
+    }
+    body.begin(NULL, false, 0);
+    http.end();
+
+    xSemaphoreGive(lock);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <HTTPClient.h>
+
+// maximum time to wait for the rest of a response body before dropping the connection
+#define HTTP_BODY_TIMEOUT 5000
+
+/**
+ * Response body of a kept-alive connection, decodes chunked transfer encoding
+ * and reports the end of the body so that the connection can be reused.
+ */
+class M5PanelHttpBodyStream : public Stream
+{
+private:
+    enum class ChunkState
+    {
+        Size,
+        Extension,
+        Data,
+        DataEnd,
+        Trailer,
+        Done
+    };
+
+    Client *client = NULL;
+    boolean chunked = false;
+    // remaining bytes of the body (or of the current chunk), -1 if unknown
+    int remaining = 0;
+    ChunkState chunkState = ChunkState::Done;
+    size_t trailerLineLength = 0;
+
+    boolean advanceToChunkData();
+
+public:
+    void begin(Client *client, boolean chunked, int size);
+    boolean finished();
+    boolean drain(unsigned long timeout);
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    void flush() override {}
+    size_t write(uint8_t) override { return 0; }
+};
+
+/**
+ * Keeps one HTTP/1.1 keep-alive connection to the openHAB host for REST reads and commands,
+ * and reconnects when the server closed it in the meantime.
+ * Requests are serialized between tasks: every GET / POST must be followed by end().
+ */
+class M5PanelHttpConnection
+{
+private:
+    WiFiClient client;
+    HTTPClient http;
+    M5PanelHttpBodyStream body;
+    SemaphoreHandle_t lock;
+    String connectedHost;
+
+    int request(const char *method, String &url, const char *contentType, String payload);
+
+public:
+    M5PanelHttpConnection();
+
+    int GET(String url);
+    int POST(String url, const char *contentType, String payload);
+
+    /** body of the current response */
+    Stream &getStream();
+    String getString();
+
+    /** finish the current request, keeping the connection open if possible */
+    void end();
+};
+
+extern M5PanelHttpConnection restConnection;
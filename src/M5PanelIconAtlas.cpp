@@ -0,0 +1,60 @@
+#include "M5PanelIconAtlas.h"
+
+M5PanelIconAtlas iconAtlas;
+
+boolean M5PanelIconAtlas::begin(uint16_t iconWidth, uint16_t iconHeight)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ICON_ATLAS_SUBTYPE, ICON_ATLAS_PARTITION);
+    if (partition == NULL)
+    {
+        log_d("M5PanelIconAtlas: no icons partition");
+        return false;
+    }
+
+    const void *mapped;
+    if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &mapHandle) != ESP_OK)
+    {
+        log_d("M5PanelIconAtlas: could not map icons partition");
+        return false;
+    }
+
+    const Header *header = (const Header *)mapped;
+    size_t bitmapSize = iconWidth * iconHeight / 2;
+    if (memcmp(header->magic, ICON_ATLAS_MAGIC, 4) != 0 || header->version != ICON_ATLAS_VERSION || header->width != iconWidth || header->height != iconHeight || sizeof(Header) + (size_t)header->count * (sizeof(Entry) + bitmapSize) > partition->size)
+    {
+        log_d("M5PanelIconAtlas: icons partition holds no valid atlas");
+        spi_flash_munmap(mapHandle);
+        return false;
+    }
+
+    atlas = (const uint8_t *)mapped;
+    entries = (const Entry *)(atlas + sizeof(Header));
+    count = header->count;
+    log_d("M5PanelIconAtlas: %d icons mapped", count);
+    return true;
+}
+
+const uint8_t *M5PanelIconAtlas::find(const char *name)
+{
+    // entries are sorted by name
+    int low = 0;
+    int high = count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        int comparison = strncmp(name, entries[middle].name, ICON_ATLAS_NAME_LENGTH);
+        if (comparison == 0)
+        {
+            return atlas + entries[middle].offset;
+        }
+        if (comparison < 0)
+        {
+            high = middle - 1;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+
+// written by tools/icons/build_icon_atlas.py, see iconatlasbuilder.py
+#define ICON_ATLAS_PARTITION "icons"
+#define ICON_ATLAS_SUBTYPE ((esp_partition_subtype_t)0x40)
+#define ICON_ATLAS_MAGIC "M5IA"
+#define ICON_ATLAS_VERSION 1
+#define ICON_ATLAS_NAME_LENGTH 40
+
+/**
+ * Prerendered 4bpp icons in a dedicated flash partition, memory mapped.
+ * Bitmaps are used in place, no filesystem access or decoding involved.
+ */
+class M5PanelIconAtlas
+{
+private:
+    struct Header
+    {
+        char magic[4];
+        uint16_t version;
+        uint16_t count;
+        uint16_t width;
+        uint16_t height;
+        uint32_t reserved;
+    };
+
+    struct Entry
+    {
+        char name[ICON_ATLAS_NAME_LENGTH];
+        uint32_t offset;
+    };
+
+    const uint8_t *atlas = NULL;
+    const Entry *entries = NULL;
+    uint16_t count = 0;
+    spi_flash_mmap_handle_t mapHandle;
+
+public:
+    /** map the icons partition, false if it is missing or holds no valid atlas */
+    boolean begin(uint16_t iconWidth, uint16_t iconHeight);
+
+    /** 4bpp bitmap of the (lowercase) icon name in mapped flash, NULL if not in the atlas */
+    const uint8_t *find(const char *name);
+};
+
+extern M5PanelIconAtlas iconAtlas;
@@ -0,0 +1,136 @@
+#include "M5PanelIconCache.h"
+#include <LittleFS.h>
+#include "M5PanelIconAtlas.h"
+
+#define ICON_BITMAP_SIZE (ICON_SIZE * ICON_SIZE / 2)
+
+M5PanelIconCache iconCache;
+
+M5PanelIconCache::M5PanelIconCache() : decodeCanvas(&M5.EPD)
+{
+    lock = xSemaphoreCreateMutex();
+}
+
+String M5PanelIconCache::resolveFile(String icon, String state)
+{
+    String key = icon + "-" + state;
+    auto resolved = resolvedFiles.find(key);
+    if (resolved != resolvedFiles.end())
+    {
+        return resolved->second;
+    }
+
+    String iconFile = "/icons/" + icon + "-" + state + ".png"; // Try to find dynamic icon ...
+    iconFile.toLowerCase();
+    if (!LittleFS.exists(iconFile))
+    {
+        iconFile = "/icons/" + icon + ".png"; // else try to find non dynamic icon
+        iconFile.toLowerCase();
+        if (!LittleFS.exists(iconFile))
+        {
+            iconFile = "";
+        }
+    }
+    resolvedFiles[key] = iconFile;
+    return iconFile;
+}
+
+void M5PanelIconCache::evict(size_t neededBytes)
+{
+    while (usedBytes + neededBytes > ICON_CACHE_BUDGET && !decodedIcons.empty())
+    {
+        auto leastRecentlyUsed = decodedIcons.begin();
+        for (auto icon = decodedIcons.begin(); icon != decodedIcons.end(); icon++)
+        {
+            if (icon->second.lastUsed < leastRecentlyUsed->second.lastUsed)
+            {
+                leastRecentlyUsed = icon;
+            }
+        }
+        log_d("M5PanelIconCache: evicting %s", leastRecentlyUsed->first.c_str());
+        free(leastRecentlyUsed->second.bitmap);
+        usedBytes -= ICON_BITMAP_SIZE;
+        decodedIcons.erase(leastRecentlyUsed);
+    }
+}
+
+uint8_t *M5PanelIconCache::decode(String iconFile)
+{
+    evict(ICON_BITMAP_SIZE);
+    uint8_t *bitmap = (uint8_t *)ps_malloc(ICON_BITMAP_SIZE);
+    if (bitmap == NULL)
+    {
+        return NULL;
+    }
+
+    // render on white, like the element background
+    decodeCanvas.createCanvas(ICON_SIZE, ICON_SIZE);
+    decodeCanvas.fillCanvas(0);
+    decodeCanvas.drawPngFile(LittleFS, iconFile.c_str(), 0, 0, 0, 0, 0, 0, 1);
+    memcpy(bitmap, decodeCanvas.frameBuffer(), ICON_BITMAP_SIZE);
+    decodeCanvas.deleteCanvas();
+
+    usedBytes += ICON_BITMAP_SIZE;
+    return bitmap;
+}
+
+const uint8_t *M5PanelIconCache::findInAtlas(String icon, String state)
+{
+    String name = icon + "-" + state; // dynamic icon first, like the icon files
+    name.toLowerCase();
+    const uint8_t *bitmap = iconAtlas.find(name.c_str());
+    if (bitmap == NULL)
+    {
+        name = icon;
+        name.toLowerCase();
+        bitmap = iconAtlas.find(name.c_str());
+    }
+    return bitmap;
+}
+
+boolean M5PanelIconCache::draw(M5EPD_Canvas *canvas, String icon, String state, int x, int y)
+{
+    // prerendered icons are copied straight from mapped flash
+    const uint8_t *atlasBitmap = findInAtlas(icon, state);
+    if (atlasBitmap != NULL)
+    {
+        canvas->pushImage(x, y, ICON_SIZE, ICON_SIZE, atlasBitmap);
+        return true;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    String iconFile = resolveFile(icon, state);
+    if (iconFile == "")
+    {
+        xSemaphoreGive(lock);
+        return false;
+    }
+
+    uint8_t *bitmap;
+    auto decoded = decodedIcons.find(iconFile);
+    if (decoded != decodedIcons.end())
+    {
+        hits++;
+        bitmap = decoded->second.bitmap;
+        decoded->second.lastUsed = ++useCounter;
+    }
+    else
+    {
+        misses++;
+        log_d("M5PanelIconCache: decoding %s (hits: %d, misses: %d, used: %d bytes)", iconFile.c_str(), hits, misses, usedBytes);
+        bitmap = decode(iconFile);
+        if (bitmap == NULL)
+        {
+            // out of PSRAM, draw without caching
+            xSemaphoreGive(lock);
+            canvas->drawPngFile(LittleFS, iconFile.c_str(), x, y, 0, 0, 0, 0, 1);
+            return true;
+        }
+        decodedIcons[iconFile] = {bitmap, ++useCounter};
+    }
+
+    canvas->pushImage(x, y, ICON_SIZE, ICON_SIZE, bitmap);
+    xSemaphoreGive(lock);
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <M5EPD.h>
+#include <unordered_map>
+#include "M5PanelPage.h"
+
+#define ICON_SIZE 96
+// PSRAM used for decoded icons, least recently used icons are evicted beyond it
+#ifndef ICON_CACHE_BUDGET
+#define ICON_CACHE_BUDGET (256 * 1024)
+#endif
+
+/**
+ * Icons decoded from PNG to the 4bpp format of the panel, held in PSRAM.
+ * Icons of the flashed icon atlas are drawn from there, LittleFS files remain for custom icons.
+ * Icon files are resolved once per (icon, state), decoded bitmaps are shared per file.
+ */
+class M5PanelIconCache
+{
+private:
+    struct DecodedIcon
+    {
+        uint8_t *bitmap;
+        uint32_t lastUsed;
+    };
+
+    /** (icon, state) to icon file, empty if there is no file */
+    std::unordered_map<String, String, M5PanelStringHash> resolvedFiles;
+    std::unordered_map<String, DecodedIcon, M5PanelStringHash> decodedIcons;
+    size_t usedBytes = 0;
+    uint32_t useCounter = 0;
+    M5EPD_Canvas decodeCanvas;
+    SemaphoreHandle_t lock;
+
+    const uint8_t *findInAtlas(String icon, String state);
+    String resolveFile(String icon, String state);
+    uint8_t *decode(String iconFile);
+    void evict(size_t neededBytes);
+
+public:
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+
+    M5PanelIconCache();
+
+    /** draw icon for state with its top left corner at (x, y), false if there is no such icon */
+    boolean draw(M5EPD_Canvas *canvas, String icon, String state, int x, int y);
+};
+
+extern M5PanelIconCache iconCache;
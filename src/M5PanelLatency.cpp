@@ -0,0 +1,202 @@
+#include "M5PanelLatency.h"
+#include <string.h>
+#ifdef ARDUINO
+#include <LittleFS.h>
+#endif
+
+M5PanelLatency latency;
+
+static const uint32_t bucketBounds[LATENCY_BUCKETS - 1] = LATENCY_BUCKET_BOUNDS;
+
+static const char *probeNames[(int)M5PanelLatencyProbe::Count] = {
+    "touch-gesture",
+    "touch-highlight",
+    "release-action",
+    "release-page",
+    "release-command",
+    "command-echo",
+    "event-update",
+    "event-draw",
+    "event-pixel"};
+
+void M5PanelLatency::add(M5PanelLatencyProbe probe, uint32_t durationMillis)
+{
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && durationMillis > bucketBounds[bucket])
+    {
+        bucket++;
+    }
+#ifdef ARDUINO
+    portENTER_CRITICAL(&histogramLock);
+#endif
+    M5PanelLatencyHistogram &histogram = histograms[(int)probe];
+    histogram.buckets[bucket]++;
+    histogram.count++;
+    histogram.max = durationMillis > histogram.max ? durationMillis : histogram.max;
+#ifdef ARDUINO
+    portEXIT_CRITICAL(&histogramLock);
+#endif
+}
+
+uint32_t M5PanelLatency::percentile(M5PanelLatencyProbe probe, int percent)
+{
+    M5PanelLatencyHistogram &histogram = histograms[(int)probe];
+    uint64_t needed = ((uint64_t)histogram.count * percent + 99) / 100;
+    uint64_t counted = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS && histogram.count > 0; bucket++)
+    {
+        counted += histogram.buckets[bucket];
+        if (counted >= needed)
+        {
+            // the last bucket has no bound of its own
+            return bucket < LATENCY_BUCKETS - 1 ? bucketBounds[bucket] : histogram.max;
+        }
+    }
+    return 0;
+}
+
+void M5PanelLatency::reset()
+{
+    memset(histograms, 0, sizeof(histograms));
+}
+
+void M5PanelLatency::format(char *line, size_t size, int probe)
+{
+    M5PanelLatencyProbe latencyProbe = (M5PanelLatencyProbe)probe;
+    snprintf(line, size, "%-16s n=%-6u p50=%-5u p95=%-5u p99=%-5u max=%u",
+             probeNames[probe], (unsigned)histograms[probe].count,
+             (unsigned)percentile(latencyProbe, 50), (unsigned)percentile(latencyProbe, 95),
+             (unsigned)percentile(latencyProbe, 99), (unsigned)histograms[probe].max);
+}
+
+void M5PanelLatency::dump(FILE *file)
+{
+    char line[96];
+    for (int probe = 0; probe < (int)M5PanelLatencyProbe::Count; probe++)
+    {
+        format(line, sizeof(line), probe);
+        fprintf(file, "%s\n", line);
+    }
+}
+
+#ifdef ARDUINO
+
+void M5PanelLatency::dump(Print &out)
+{
+    char line[96];
+    out.println("latency (ms):");
+    for (int probe = 0; probe < (int)M5PanelLatencyProbe::Count; probe++)
+    {
+        format(line, sizeof(line), probe);
+        out.println(line);
+    }
+}
+
+boolean M5PanelLatency::load()
+{
+    File file = LittleFS.open(LATENCY_FILE);
+    if (!file)
+    {
+        return false;
+    }
+    uint32_t version = 0;
+    boolean loaded = file.read((uint8_t *)&version, sizeof(version)) == sizeof(version) && version == LATENCY_FILE_VERSION &&
+                     file.read((uint8_t *)histograms, sizeof(histograms)) == sizeof(histograms);
+    file.close();
+    if (!loaded)
+    {
+        reset();
+    }
+    return loaded;
+}
+
+boolean M5PanelLatency::save()
+{
+    File file = LittleFS.open(LATENCY_FILE, "w", true);
+    if (!file)
+    {
+        return false;
+    }
+    uint32_t version = LATENCY_FILE_VERSION;
+    file.write((uint8_t *)&version, sizeof(version));
+    file.write((uint8_t *)histograms, sizeof(histograms));
+    file.close();
+    return true;
+}
+
+void M5PanelLatency::startTouch(unsigned long millis)
+{
+    touchMillis = millis;
+}
+
+void M5PanelLatency::recordTouch(M5PanelLatencyProbe probe)
+{
+    add(probe, millis() - touchMillis);
+}
+
+void M5PanelLatency::commandQueued(String widgetId)
+{
+    recordTouch(M5PanelLatencyProbe::ReleaseToCommand);
+    // the oldest command gives way
+    Command *slot = &commands[0];
+    for (Command &command : commands)
+    {
+        if (strcmp(command.widgetId, widgetId.c_str()) == 0)
+        {
+            slot = &command;
+            break;
+        }
+        slot = command.millis < slot->millis ? &command : slot;
+    }
+    strlcpy(slot->widgetId, widgetId.c_str(), sizeof(slot->widgetId));
+    slot->millis = millis();
+}
+
+void M5PanelLatency::echoReceived(String widgetId)
+{
+    for (Command &command : commands)
+    {
+        if (command.widgetId[0] != '\0' && strcmp(command.widgetId, widgetId.c_str()) == 0)
+        {
+            add(M5PanelLatencyProbe::CommandToEcho, millis() - command.millis);
+            command.widgetId[0] = '\0';
+            command.millis = 0;
+        }
+    }
+}
+
+void M5PanelLatency::startEvent(unsigned long millis)
+{
+    eventMillis = millis;
+}
+
+void M5PanelLatency::finishEvent()
+{
+    add(M5PanelLatencyProbe::EventToUpdate, millis() - eventMillis);
+    eventMillis = 0;
+}
+
+void M5PanelLatency::eventDrawn()
+{
+    // page fetches update widgets outside of events
+    if (eventMillis == 0)
+    {
+        return;
+    }
+    add(M5PanelLatencyProbe::EventToDraw, millis() - eventMillis);
+    if (drawnEventMillis == 0)
+    {
+        drawnEventMillis = eventMillis;
+    }
+}
+
+void M5PanelLatency::eventsShown()
+{
+    if (drawnEventMillis != 0)
+    {
+        add(M5PanelLatencyProbe::EventToPixel, millis() - drawnEventMillis);
+        drawnEventMillis = 0;
+    }
+}
+
+#endif
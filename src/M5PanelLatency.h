@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+// histograms of the last wakes, accumulated over deep sleep
+#define LATENCY_FILE "/latency"
+#define LATENCY_FILE_VERSION 1
+
+// upper bounds of the histogram buckets (ms), the last bucket takes everything above
+#define LATENCY_BUCKET_BOUNDS {1, 2, 3, 5, 7, 10, 15, 20, 30, 50, 70, 100, 150, 200, 300, 500, 700, 1000, 1500, 2000, 3000, 5000, 7000, 10000}
+#define LATENCY_BUCKETS 25
+
+// commands waiting for their echo at the same time
+#define LATENCY_COMMAND_SLOTS 4
+#define LATENCY_WIDGET_ID_SIZE 64
+
+enum class M5PanelLatencyProbe
+{
+    /** finger down or up to the gesture reaching checkTouch */
+    TouchToGesture,
+    /** finger down to the refresh of the highlight */
+    TouchToHighlight,
+    /** finger up to processTouch being done */
+    ReleaseToAction,
+    /** finger up to the new page being on the panel */
+    ReleaseToPage,
+    /** finger up to the command being queued by postValue */
+    ReleaseToCommand,
+    /** command queued to the subscription update of its widget */
+    CommandToEcho,
+    /** subscription event received to updateWidget being done */
+    EventToUpdate,
+    /** subscription event received to its element being drawn */
+    EventToDraw,
+    /** oldest drawn subscription event received to the refresh of its batch */
+    EventToPixel,
+    Count
+};
+
+/** fixed bucket histogram of one probe */
+struct M5PanelLatencyHistogram
+{
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+};
+
+/**
+ * Latency histograms of the touch and the subscription update paths, for comparing firmware changes.
+ * Probes measure from the start of their path, percentiles are reported as the upper bound of their bucket.
+ */
+class M5PanelLatency
+{
+private:
+    M5PanelLatencyHistogram histograms[(int)M5PanelLatencyProbe::Count] = {};
+
+#ifdef ARDUINO
+    portMUX_TYPE histogramLock = portMUX_INITIALIZER_UNLOCKED;
+    unsigned long touchMillis = 0;
+    unsigned long eventMillis = 0;
+    unsigned long drawnEventMillis = 0;
+    struct Command
+    {
+        char widgetId[LATENCY_WIDGET_ID_SIZE];
+        unsigned long millis;
+    };
+    Command commands[LATENCY_COMMAND_SLOTS] = {};
+#endif
+
+    void format(char *line, size_t size, int probe);
+
+public:
+    /** count a duration of the probe */
+    void add(M5PanelLatencyProbe probe, uint32_t durationMillis);
+    /** upper bucket bound below which percent of the durations are, 0 without durations */
+    uint32_t percentile(M5PanelLatencyProbe probe, int percent);
+    void reset();
+
+    /** write one line per probe with count, p50, p95, p99 and max */
+    void dump(FILE *file);
+
+#ifdef ARDUINO
+    void dump(Print &out);
+    boolean load();
+    boolean save();
+
+    /** start of the touch path, the time of the finger down or up event */
+    void startTouch(unsigned long millis);
+    void recordTouch(M5PanelLatencyProbe probe);
+    /** the command of a touch was queued, its echo is measured in echoReceived */
+    void commandQueued(String widgetId);
+    void echoReceived(String widgetId);
+
+    /** start of the subscription update path, the time the event was received */
+    void startEvent(unsigned long millis);
+    /** the update of the event is done, later draws belong to other updates */
+    void finishEvent();
+    /** the element of the event was drawn, its refresh follows with the batch */
+    void eventDrawn();
+    /** the batch with the drawn events was refreshed */
+    void eventsShown();
+#endif
+};
+
+extern M5PanelLatency latency;
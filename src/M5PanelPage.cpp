@@ -1,6 +1,9 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include "M5PanelUI.h"
+#include "M5PanelPrerenderer.h"
+#include <vector>
+#include <algorithm>
 
 // M5PanelPage
 
@@ -15,6 +18,7 @@ M5PanelPage::M5PanelPage(M5PanelUIElement *parent, JsonObject json, int pageInde
     String widgetId = json["widgetId"].isNull() ? "" : json["widgetId"].as<String>();
     String id = json["id"].isNull() ? "" : json["id"].as<String>();
     identifier = id + widgetId + "_" + pageIndex;
+    pageRegistry[identifier] = this;
 
     // the root page has title, the subpages labels
     String label = json["label"].isNull() ? "" : json["label"].as<String>();
@@ -25,6 +29,7 @@ M5PanelPage::M5PanelPage(M5PanelUIElement *parent, JsonObject json, int pageInde
 
     size_t pageOffset = pageIndex * MAX_ELEMENTS;
     JsonArray widgets = json["widgets"];
+    hasContent = !widgets.isNull();
     numElements = min((size_t)MAX_ELEMENTS, widgets.size() - pageOffset);
 
     // initialize elements on page
@@ -32,6 +37,10 @@ M5PanelPage::M5PanelPage(M5PanelUIElement *parent, JsonObject json, int pageInde
     {
         JsonObject elementJson = widgets[pageOffset + i];
         elements[i] = new M5PanelUIElement(this, elementJson);
+        if (elements[i]->identifier != "")
+        {
+            widgetIndex[elements[i]->identifier] = {elements[i], this, i};
+        }
     }
 
     // initialize additional pages if necessary
@@ -54,6 +63,7 @@ M5PanelPage::M5PanelPage(JsonObject json, M5PanelUIElement *selection, int pageI
     JsonArray choices = json["item"]["stateDescription"]["options"];
 
     identifier = selection->identifier + "_choices_" + pageIndex;
+    pageRegistry[identifier] = this;
     title = selection->title;
     size_t pageOffset = pageIndex * MAX_ELEMENTS;
     numElements = min((size_t)MAX_ELEMENTS, choices.size() - pageOffset);
@@ -73,13 +83,183 @@ M5PanelPage::M5PanelPage(JsonObject json, M5PanelUIElement *selection, int pageI
     next->previous = this;
 }
 
+M5PanelPage *M5PanelPage::find(String identifier)
+{
+    auto found = pageRegistry.find(identifier);
+    return found == pageRegistry.end() ? NULL : found->second;
+}
+
+M5PanelPage *M5PanelPage::findOrBuild(M5PanelPage *root, String identifier)
+{
+    M5PanelPage *found = find(identifier);
+    int choicesIdx = identifier.lastIndexOf("_choices_");
+    int pageSeparatorIdx = choicesIdx >= 0 ? choicesIdx : identifier.lastIndexOf('_');
+    if (found != NULL || pageSeparatorIdx < 0)
+    {
+        return found;
+    }
+
+    // widget ids extend the id of the page or frame they are on, and linked pages have the id of their widget:
+    // follow the elements whose id starts the id of the page, building only their pages
+    String pathId = identifier.substring(0, pageSeparatorIdx);
+    size_t matched = 0;
+    M5PanelPage *page = root;
+    while (found == NULL && page != NULL)
+    {
+        M5PanelUIElement *step = NULL;
+        for (M5PanelPage *pagination = page; pagination != NULL && step == NULL; pagination = pagination->next)
+        {
+            for (size_t i = 0; i < pagination->numElements && step == NULL; i++)
+            {
+                String &elementId = pagination->elements[i]->identifier;
+                if (elementId.length() > matched && pathId.startsWith(elementId))
+                {
+                    step = pagination->elements[i];
+                }
+            }
+        }
+        if (step == NULL)
+        {
+            return NULL;
+        }
+
+        matched = step->identifier.length();
+        if (choicesIdx >= 0 && matched == pathId.length())
+        {
+            step->getChoices();
+            page = NULL;
+        }
+        else
+        {
+            page = step->getDetail();
+        }
+        found = find(identifier);
+    }
+    return found;
+}
+
+void M5PanelPage::evictPages(M5PanelPage *root, M5PanelPage *currentPage)
+{
+    // elements on the way from the root to the current page keep their pages
+    std::vector<M5PanelUIElement *> path;
+    for (M5PanelPage *page = currentPage; page != NULL && page->parent != NULL; page = page->parent->parent)
+    {
+        path.push_back(page->parent);
+    }
+
+    std::vector<M5PanelPage *> pages;
+    if (root != NULL)
+    {
+        pages.push_back(root);
+    }
+    while (!pages.empty())
+    {
+        M5PanelPage *page = pages.back();
+        pages.pop_back();
+        if (page->next != NULL)
+        {
+            pages.push_back(page->next);
+        }
+        for (size_t i = 0; i < page->numElements; i++)
+        {
+            M5PanelUIElement *element = page->elements[i];
+            if (std::find(path.begin(), path.end(), element) == path.end())
+            {
+                element->evictPages();
+                continue;
+            }
+            if (element->detail != NULL)
+            {
+                pages.push_back(element->detail);
+            }
+            if (element->choices != NULL)
+            {
+                pages.push_back(element->choices);
+            }
+        }
+    }
+}
+
 M5PanelPage::~M5PanelPage()
 {
     log_d("delete page %s (%s)", title.c_str(), identifier.c_str());
-    for (size_t i = 0; i < MAX_ELEMENTS; i++)
+    auto indexed = pageRegistry.find(identifier);
+    if (indexed != pageRegistry.end() && indexed->second == this)
     {
-        delete elements[i];
+        pageRegistry.erase(indexed);
     }
-    delete previous;
-    delete next;
+    prerenderer.forget(this);
+}
+
+void *M5PanelPage::operator new(size_t size)
+{
+    return treeArena.allocate(size);
+}
+
+void M5PanelPage::operator delete(void *page, size_t size)
+{
+    treeArena.release(page, size);
+}
+
+/**
+ * delete pages and elements with everything they own, without recursion:
+ * pages own their elements and following pages, elements their detail and choices pages
+ */
+static void destroySubtree(M5PanelPage *page, M5PanelUIElement *element)
+{
+    std::vector<M5PanelPage *> pages;
+    std::vector<M5PanelUIElement *> elements;
+    if (page != NULL)
+    {
+        pages.push_back(page);
+    }
+    if (element != NULL)
+    {
+        elements.push_back(element);
+    }
+
+    while (!pages.empty() || !elements.empty())
+    {
+        if (!elements.empty())
+        {
+            M5PanelUIElement *current = elements.back();
+            elements.pop_back();
+            if (current->detail != NULL)
+            {
+                pages.push_back(current->detail);
+            }
+            if (current->choices != NULL)
+            {
+                pages.push_back(current->choices);
+            }
+            delete current;
+            continue;
+        }
+
+        M5PanelPage *current = pages.back();
+        pages.pop_back();
+        if (current->next != NULL)
+        {
+            current->next->previous = NULL;
+            pages.push_back(current->next);
+        }
+        for (size_t i = 0; i < MAX_ELEMENTS; i++)
+        {
+            if (current->elements[i] != NULL)
+            {
+                elements.push_back(current->elements[i]);
+            }
+        }
+        delete current;
+    }
+}
+
+void M5PanelPage::destroy(M5PanelPage *page)
+{
+    destroySubtree(page, NULL);
+}
+
+void M5PanelUIElement::destroy(M5PanelUIElement *element)
+{
+    destroySubtree(NULL, element);
 }
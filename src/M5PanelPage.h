@@ -1,22 +1,105 @@
+#pragma once
+
 #include <ArduinoJson.h>
 #include <M5EPD.h>
+#include <unordered_map>
+#include "M5PanelArena.h"
 
 class M5PanelUIElement;
+class M5PanelPage;
+
+/** position of a widget in the page tree */
+struct M5PanelWidgetLocation
+{
+    M5PanelUIElement *element;
+    M5PanelPage *page;
+    size_t slot;
+};
+
+/** content hashes of what the panel shows, see M5PanelPage::drawChanged */
+struct M5PanelRenderedContent
+{
+    uint32_t page;
+    uint32_t elements[6];
+};
+
+/** what a touch acts on and the panel area highlighted for it, see M5PanelPage::pressTouch */
+struct M5PanelTouchTarget
+{
+    /** index of the touched element, -1 for the navigation column */
+    int element;
+    int arrow;
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/** states of a widget whose page was evicted, see M5PanelPage::evictedStates */
+struct M5PanelWidgetStates
+{
+    String label;
+    String state;
+    String itemState;
+};
+
+struct M5PanelStringHash
+{
+    size_t operator()(const String &string) const;
+};
 
 class M5PanelPage
 {
 private:
     size_t numElements;
 
+    /** offscreen framebuffer the page is drawn into instead of the panel, see prerender */
+    static M5EPD_Canvas *renderTarget;
+    /** what renderTarget holds, renderedContent while drawing to the panel */
+    static M5PanelRenderedContent *renderTargetContent;
+
     M5PanelPage(M5PanelUIElement *parent, JsonObject json, int pageIndex);
     M5PanelPage(JsonObject json, M5PanelUIElement *selection, int pageIndex);
 
+    void getElementOrigin(int elementIndex, int *x, int *y);
     void drawElement(M5EPD_Canvas *canvas, int elementIndex, boolean updateImmediately);
+    /** draw element and leave the refresh to the update batcher */
+    void drawElementBatched(M5EPD_Canvas *canvas, int elementIndex);
+    /** draw element and refresh only its value, for values changed by the user */
+    void drawElementValue(M5EPD_Canvas *canvas, int elementIndex);
     void drawNavigation(M5EPD_Canvas *canvas);
+    M5PanelPage *getArrowTarget(int arrow);
+    boolean getTouchTarget(uint16_t x, uint16_t y, M5PanelTouchTarget *target);
     M5PanelPage *processNavigationTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas);
     M5PanelPage *processElementTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas);
 
 public:
+    /** all widgets of the current tree by widgetId, maintained by element construction and destruction */
+    static std::unordered_map<String, M5PanelWidgetLocation, M5PanelStringHash> widgetIndex;
+    /** all pages of the current tree by identifier, including choices and pagination pages */
+    static std::unordered_map<String, M5PanelPage *, M5PanelStringHash> pageRegistry;
+    /**
+     * latest states of widgets on evicted pages, which are newer than the page sources they are built again from;
+     * taken over when the widget is built, dropped when a newer source is stored
+     */
+    static std::unordered_map<String, M5PanelWidgetStates, M5PanelStringHash> evictedStates;
+
+    /** page with the given identifier in the current tree, or NULL */
+    static M5PanelPage *find(String identifier);
+    /**
+     * like find, but builds the detail and choices pages on the way from root to the page;
+     * returns NULL without building anything off that way if the page does not exist
+     */
+    static M5PanelPage *findOrBuild(M5PanelPage *root, String identifier);
+    /** delete built pages that do not lead to the current page, they are built again when used */
+    static void evictPages(M5PanelPage *root, M5PanelPage *currentPage);
+
+    /** content currently on the panel, persisted over deep sleep */
+    static M5PanelRenderedContent renderedContent;
+
+    /** put a drawn canvas at (x, y) of the panel, or of the framebuffer while prerendering */
+    static void present(M5EPD_Canvas *canvas, int x, int y);
+
     String title;
     int pageIndex;
     M5PanelUIElement *elements[6] = {NULL, NULL, NULL, NULL, NULL, NULL};
@@ -25,24 +108,64 @@ public:
     M5PanelUIElement *parent = NULL;
 
     String identifier = "";
+    /** false for a linked page known only by its id and title, its widgets have to be fetched */
+    boolean hasContent = true;
 
     M5PanelPage(M5PanelUIElement *parent, JsonObject json);
     /** create choices page */
     M5PanelPage(JsonObject json, M5PanelUIElement *selection);
     ~M5PanelPage();
 
-    boolean draw(String pageIdentifier, M5EPD_Canvas *canvas);
+    /** pages are allocated from treeArena, delete only runs the destructor */
+    static void *operator new(size_t size);
+    static void operator delete(void *page, size_t size);
+    /** delete the page with its following pages and their elements, use instead of delete */
+    static void destroy(M5PanelPage *page);
+
     void draw(M5EPD_Canvas *canvas);
+    /**
+     * refresh only the elements that differ from renderedContent,
+     * returns false without drawing if the panel shows a different page;
+     * with panelMemoryCleared the unchanged parts are written to the controller memory again without refreshing them
+     */
+    boolean drawChanged(M5EPD_Canvas *canvas, boolean panelMemoryCleared = false);
+    uint32_t contentHash();
+    /**
+     * bring the page in the full page framebuffer target up to date, content describes what it holds;
+     * returns false if nothing had to be drawn
+     */
+    boolean prerender(M5EPD_Canvas *canvas, M5EPD_Canvas *target, M5PanelRenderedContent *content);
+
+    /**
+     * react to touch in a certain place of this page and return the new current page
+     */
+    M5PanelPage *processTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas);
 
+    /** press phase of a touch: highlight what a finger down at (x, y) acts on, false if nothing */
+    boolean pressTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas);
     /**
-     * react to touch in a certain place and return the new currentElement
+     * commit phase of a touch pressed at (pressX, pressY): process it if the finger was lifted at (x, y)
+     * on the same target, else cancel it; returns the new current page
      */
-    M5PanelPage *processTouch(String currentElement, uint16_t x, uint16_t y, M5EPD_Canvas *canvas);
+    M5PanelPage *releaseTouch(uint16_t pressX, uint16_t pressY, uint16_t x, uint16_t y, M5EPD_Canvas *canvas);
+    /** remove the highlight of a touch pressed at (x, y) */
+    void cancelTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas);
+    /** page a touch at (x, y) would navigate to, without acting on it; NULL if it does not navigate */
+    M5PanelPage *getNavigationTarget(uint16_t x, uint16_t y);
 
     /**
      * update widget and report the page where this was found
      */
-    M5PanelPage *updateWidget(JsonObject json, String widgetId, String currentPage, M5EPD_Canvas *canvas);
+    static M5PanelPage *updateWidget(JsonObject json, String widgetId, M5PanelPage *currentPage, M5EPD_Canvas *canvas);
+
+    /** drop the pending value of a widget after its command failed and redraw it if it is on the current page */
+    static void rollbackWidget(String widgetId, M5PanelPage *currentPage, M5EPD_Canvas *canvas);
 
     void updateAllWidgets(DynamicJsonDocument json);
+
+    /**
+     * take over the page json of a changed sitemap, replacing only changed elements;
+     * returns false if the page layout changed and the page has to be rebuilt
+     */
+    boolean reconcile(JsonObject json);
 };
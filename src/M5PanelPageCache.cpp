@@ -0,0 +1,97 @@
+#include "M5PanelPageCache.h"
+#include <LittleFS.h>
+#include <ezTime.h>
+
+static String cachedPageFile(String pageId)
+{
+    return String(PAGE_CACHE_DIR) + "/" + pageId;
+}
+
+boolean saveCachedPage(String pageId, JsonDocument &page)
+{
+    File file = LittleFS.open(cachedPageFile(pageId), "w", true);
+    if (!file)
+    {
+        log_d("saveCachedPage: could not open cache file of %s", pageId.c_str());
+        return false;
+    }
+    // freshness marker first, then the page as MessagePack; 0 until NTP set the clock
+    uint32_t fetched = timeStatus() == timeSet ? UTC.now() : 0;
+    file.write((uint8_t *)&fetched, sizeof(fetched));
+    size_t written = serializeMsgPack(page, file);
+    file.close();
+    return written > 0;
+}
+
+static File openCachedPage(String pageId, uint32_t *fetched)
+{
+    String fileName = cachedPageFile(pageId);
+    if (!LittleFS.exists(fileName))
+    {
+        return File();
+    }
+    File file = LittleFS.open(fileName);
+    if (file && file.read((uint8_t *)fetched, sizeof(*fetched)) != sizeof(*fetched))
+    {
+        file.close();
+        return File();
+    }
+    return file;
+}
+
+boolean loadCachedPage(String pageId, JsonDocument &page)
+{
+    uint32_t fetched;
+    File file = openCachedPage(pageId, &fetched);
+    if (!file)
+    {
+        return false;
+    }
+    DeserializationError error = deserializeMsgPack(page, file, DeserializationOption::NestingLimit(50));
+    file.close();
+    if (error)
+    {
+        log_d("loadCachedPage: %s", error.c_str());
+        page.clear();
+        return false;
+    }
+    return true;
+}
+
+uint32_t cachedPageAge(String pageId)
+{
+    uint32_t fetched;
+    File file = openCachedPage(pageId, &fetched);
+    if (!file)
+    {
+        return UINT32_MAX;
+    }
+    file.close();
+    if (fetched == 0 || timeStatus() != timeSet)
+    {
+        return PAGE_CACHE_AGE_UNKNOWN;
+    }
+    uint32_t now = UTC.now();
+    return now > fetched ? now - fetched : 0;
+}
+
+void clearPageCache()
+{
+    File directory = LittleFS.open(PAGE_CACHE_DIR);
+    if (!directory || !directory.isDirectory())
+    {
+        return;
+    }
+    std::vector<String> fileNames;
+    for (File file = directory.openNextFile(); file; file = directory.openNextFile())
+    {
+        fileNames.push_back(cachedPageFile(file.name()));
+        file.close();
+    }
+    directory.close();
+    for (String &fileName : fileNames)
+    {
+        LittleFS.remove(fileName);
+    }
+    log_d("clearPageCache: %d pages removed", fileNames.size());
+}
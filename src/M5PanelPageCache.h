@@ -0,0 +1,30 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include "defs.h"
+
+// fetch single pages from /rest/sitemaps/<sitemap>/<pageId> instead of the whole sitemap
+#ifndef SITEMAP_PAGE_LOADING
+#define SITEMAP_PAGE_LOADING false
+#endif
+
+#define PAGE_CACHE_DIR "/pages"
+#define PAGE_CACHE_DOCUMENT_SIZE 16384
+// age in seconds after which cached pages are fetched again
+#ifndef PAGE_CACHE_MAX_AGE
+#define PAGE_CACHE_MAX_AGE 3600
+#endif
+// age of pages fetched or checked before the clock was synchronized, older than PAGE_CACHE_MAX_AGE
+#define PAGE_CACHE_AGE_UNKNOWN (UINT32_MAX - 1)
+
+/** store a page fetched from /rest/sitemaps/<sitemap>/<pageId> together with the time it was fetched */
+boolean saveCachedPage(String pageId, JsonDocument &page);
+
+/** read a page stored by saveCachedPage */
+boolean loadCachedPage(String pageId, JsonDocument &page);
+
+/** seconds since the page was fetched, UINT32_MAX if it is not cached, PAGE_CACHE_AGE_UNKNOWN without synchronized clock */
+uint32_t cachedPageAge(String pageId);
+
+/** forget all cached pages, e.g. when the sitemap changed */
+void clearPageCache();
@@ -0,0 +1,135 @@
+#include "M5PanelPagePrefetcher.h"
+
+M5PanelPagePrefetcher pagePrefetcher;
+
+void M5PanelPagePrefetcher::begin(M5PanelPageFetch fetch)
+{
+    this->fetch = fetch;
+    requested = xSemaphoreCreateBinary();
+    lock = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(prefetchLoop, "prefetchLoop", 4096, this, 1, NULL, 0);
+}
+
+void M5PanelPagePrefetcher::prefetchLoop(void *pvParameters)
+{
+    ((M5PanelPagePrefetcher *)pvParameters)->serve();
+}
+
+void M5PanelPagePrefetcher::serve()
+{
+    while (true)
+    {
+        xSemaphoreTake(requested, portMAX_DELAY);
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        String requestUrl = url;
+        uint32_t requestGeneration = generation;
+        boolean keepResult = keep;
+        xSemaphoreGive(lock);
+
+        log_d("prefetchLoop: fetching %s", requestUrl.c_str());
+        DynamicJsonDocument *document = new DynamicJsonDocument(PREFETCH_DOCUMENT_SIZE);
+        boolean fetched = fetch(requestUrl, *document);
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (requestGeneration == generation)
+        {
+            running = false;
+            if (fetched && keepResult)
+            {
+                result = document;
+                document = NULL;
+            }
+        }
+        xSemaphoreGive(lock);
+        delete document;
+    }
+}
+
+void M5PanelPagePrefetcher::clear()
+{
+    generation++;
+    pageId = "";
+    running = false;
+    delete result;
+    result = NULL;
+}
+
+void M5PanelPagePrefetcher::start(String pageId, String url, boolean keep)
+{
+    if (fetch == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    clear();
+    this->pageId = pageId;
+    this->url = url;
+    this->keep = keep;
+    running = true;
+    xSemaphoreGive(lock);
+    xSemaphoreGive(requested);
+}
+
+boolean M5PanelPagePrefetcher::pending(String pageId)
+{
+    if (fetch == NULL)
+    {
+        return false;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    boolean requested = this->pageId == pageId && keep;
+    xSemaphoreGive(lock);
+    return requested;
+}
+
+boolean M5PanelPagePrefetcher::finished(String pageId)
+{
+    if (fetch == NULL)
+    {
+        return false;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    boolean done = this->pageId == pageId && keep && !running;
+    xSemaphoreGive(lock);
+    return done;
+}
+
+boolean M5PanelPagePrefetcher::take(String pageId, JsonDocument &doc)
+{
+    if (fetch == NULL)
+    {
+        return false;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (this->pageId != pageId || !keep || running)
+    {
+        xSemaphoreGive(lock);
+        return false;
+    }
+    boolean taken = result != NULL && doc.set(*result);
+    if (!taken)
+    {
+        log_d("take: fetching %s failed", pageId.c_str());
+    }
+    clear();
+    xSemaphoreGive(lock);
+    return taken;
+}
+
+boolean M5PanelPagePrefetcher::discard(String keepPageId)
+{
+    if (fetch == NULL)
+    {
+        return false;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    boolean dropped = pageId != "" && pageId != keepPageId;
+    if (dropped)
+    {
+        log_d("discard: dropping prefetch of %s", pageId.c_str());
+        clear();
+    }
+    xSemaphoreGive(lock);
+    return dropped;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "defs.h"
+
+// capacity of prefetched page documents, like the documents of subscribePage
+#define PREFETCH_DOCUMENT_SIZE 60000
+
+typedef bool (*M5PanelPageFetch)(String &url, JsonDocument &doc);
+
+/**
+ * Fetches pages from a task of its own, so that nobody waits for the network while holding the page:
+ * the page a touch is about to navigate to while the finger is still down, and the current page.
+ */
+class M5PanelPagePrefetcher
+{
+private:
+    M5PanelPageFetch fetch = NULL;
+    SemaphoreHandle_t requested = NULL;
+    SemaphoreHandle_t lock = NULL;
+
+    // guarded by lock
+    String pageId;
+    String url;
+    boolean keep = false;
+    boolean running = false;
+    /** counts requests, a fetch of an outdated request is discarded */
+    uint32_t generation = 0;
+    DynamicJsonDocument *result = NULL;
+
+    static void prefetchLoop(void *pvParameters);
+    void serve();
+    void clear();
+
+public:
+    /** start the prefetch task, fetch performs the requests */
+    void begin(M5PanelPageFetch fetch);
+
+    /**
+     * fetch url for the page pageId in the background, replacing the previous request;
+     * without keep the result is not kept, for requests made for their side effects only
+     */
+    void start(String pageId, String url, boolean keep = true);
+
+    /** true if the result of pageId is requested and not taken yet, whether it is still fetched or not */
+    boolean pending(String pageId);
+
+    /** true if the request for pageId finished and can be taken without waiting */
+    boolean finished(String pageId);
+
+    /**
+     * copy the prefetched page into doc and forget the request, without waiting for it;
+     * false if pageId was not prefetched, its request failed or is still running
+     */
+    boolean take(String pageId, JsonDocument &doc);
+
+    /** drop the request unless it is for keepPageId, true if one was dropped */
+    boolean discard(String keepPageId);
+};
+
+extern M5PanelPagePrefetcher pagePrefetcher;
@@ -0,0 +1,127 @@
+#include "M5PanelPrerenderer.h"
+#include "M5PanelUI.h"
+#include "M5PanelUI_LayoutConstants.h"
+#include "M5PanelRefreshScheduler.h"
+
+M5PanelPrerenderer prerenderer;
+
+M5PanelPrerenderer::Slot *M5PanelPrerenderer::findSlot(M5PanelPage *page)
+{
+    for (size_t i = 0; i < PRERENDER_PAGES; i++)
+    {
+        if (slots[i].page == page && page != NULL)
+        {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+size_t M5PanelPrerenderer::collectCandidates(M5PanelPage *currentPage, M5PanelPage **candidates)
+{
+    // most likely targets first: the navigation arrows, then the pages behind elements
+    M5PanelPage *reachable[3 + 2 * MAX_ELEMENTS] = {
+        currentPage->next,
+        currentPage->previous,
+        currentPage->parent != NULL ? currentPage->parent->parent : NULL};
+    size_t numReachable = 3;
+    for (size_t i = 0; i < MAX_ELEMENTS && currentPage->elements[i] != NULL; i++)
+    {
+        // builds pages that were not visited yet
+        reachable[numReachable++] = currentPage->elements[i]->getDetail();
+        reachable[numReachable++] = currentPage->elements[i]->getChoices();
+    }
+
+    size_t numCandidates = 0;
+    for (size_t i = 0; i < numReachable && numCandidates < PRERENDER_PAGES; i++)
+    {
+        if (reachable[i] != NULL && reachable[i] != currentPage)
+        {
+            candidates[numCandidates++] = reachable[i];
+        }
+    }
+    return numCandidates;
+}
+
+boolean M5PanelPrerenderer::step(M5PanelPage *currentPage, M5EPD_Canvas *canvas)
+{
+    if (currentPage == NULL)
+    {
+        return false;
+    }
+
+    M5PanelPage *candidates[PRERENDER_PAGES];
+    size_t numCandidates = collectCandidates(currentPage, candidates);
+
+    for (size_t i = 0; i < numCandidates; i++)
+    {
+        Slot *slot = findSlot(candidates[i]);
+        if (slot == NULL)
+        {
+            // take over the slot of a page that is no longer reachable
+            for (size_t j = 0; j < PRERENDER_PAGES && slot == NULL; j++)
+            {
+                boolean stillCandidate = false;
+                for (size_t k = 0; k < numCandidates; k++)
+                {
+                    stillCandidate |= slots[j].page == candidates[k];
+                }
+                if (!stillCandidate)
+                {
+                    slot = &slots[j];
+                }
+            }
+            slot->page = candidates[i];
+            slot->content.page = 0;
+            if (slot->framebuffer == NULL)
+            {
+                slot->framebuffer = new M5EPD_Canvas(&M5.EPD);
+                if (slot->framebuffer->createCanvas(PANEL_WIDTH, PANEL_HEIGHT) == NULL)
+                {
+                    log_d("M5PanelPrerenderer: out of memory for framebuffer");
+                    delete slot->framebuffer;
+                    slot->framebuffer = NULL;
+                    slot->page = NULL;
+                    return false;
+                }
+            }
+        }
+
+        // one page per step keeps the drawing lock short
+        if (slot->page->prerender(canvas, slot->framebuffer, &slot->content))
+        {
+            log_d("M5PanelPrerenderer: rendered %s", slot->page->identifier.c_str());
+            return true;
+        }
+    }
+    return false;
+}
+
+boolean M5PanelPrerenderer::show(M5PanelPage *page, M5EPD_Canvas *canvas)
+{
+    Slot *slot = findSlot(page);
+    if (slot == NULL)
+    {
+        misses++;
+        return false;
+    }
+    hits++;
+    log_d("M5PanelPrerenderer: showing prerendered %s (hits: %d, misses: %d)", page->identifier.c_str(), hits, misses);
+
+    // catch up with updates that arrived since the last step
+    page->prerender(canvas, slot->framebuffer, &slot->content);
+
+    slot->framebuffer->pushCanvas(0, 0, UPDATE_MODE_NONE);
+    refreshScheduler.refreshFull();
+    M5PanelPage::renderedContent = slot->content;
+    return true;
+}
+
+void M5PanelPrerenderer::forget(M5PanelPage *page)
+{
+    Slot *slot = findSlot(page);
+    if (slot != NULL)
+    {
+        slot->page = NULL;
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <M5EPD.h>
+#include "defs.h"
+#include "M5PanelPage.h"
+
+// pages around the current page kept rendered in PSRAM (PANEL_WIDTH * PANEL_HEIGHT / 2 bytes each)
+#ifndef PRERENDER_PAGES
+#define PRERENDER_PAGES 6
+#endif
+
+/**
+ * Renders the pages reachable from the current page (next, previous, parent, detail and choices pages)
+ * into offscreen framebuffers while the panel is idle, so that a page change is a single blit.
+ * Buffers are brought up to date element by element as widget updates arrive.
+ */
+class M5PanelPrerenderer
+{
+private:
+    struct Slot
+    {
+        M5PanelPage *page;
+        M5EPD_Canvas *framebuffer;
+        M5PanelRenderedContent content;
+    };
+
+    Slot slots[PRERENDER_PAGES] = {};
+
+    Slot *findSlot(M5PanelPage *page);
+    size_t collectCandidates(M5PanelPage *currentPage, M5PanelPage **candidates);
+
+public:
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+
+    /**
+     * render one out of date page around the current page, to be called while the panel is idle;
+     * returns false if all of them are up to date
+     */
+    boolean step(M5PanelPage *currentPage, M5EPD_Canvas *canvas);
+
+    /** put the prerendered page on the panel with a full refresh, false if it was not prerendered */
+    boolean show(M5PanelPage *page, M5EPD_Canvas *canvas);
+
+    /** drop the framebuffer of a page that is deleted */
+    void forget(M5PanelPage *page);
+};
+
+extern M5PanelPrerenderer prerenderer;
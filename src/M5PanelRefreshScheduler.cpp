@@ -0,0 +1,150 @@
+#include "M5PanelRefreshScheduler.h"
+#include <M5EPD.h>
+#include "M5PanelLatency.h"
+
+M5PanelRefreshScheduler refreshScheduler;
+
+// Immediate refreshes
+
+void M5PanelRefreshScheduler::refresh(int x, int y, int width, int height, M5PanelContent content)
+{
+    M5.EPD.UpdateArea(x, y, width, height, content == M5PanelContent::Binary ? UPDATE_MODE_DU : UPDATE_MODE_GL16);
+    countPartialRefresh(x, y, width, height);
+    lastRefreshMillis = millis();
+}
+
+void M5PanelRefreshScheduler::refreshFull()
+{
+    M5.EPD.UpdateFull(UPDATE_MODE_GLD16);
+    memset(partialRefreshes, 0, sizeof(partialRefreshes));
+    lastRefreshMillis = millis();
+    // pending element updates are part of the full refresh
+    clear();
+    latency.eventsShown();
+}
+
+void M5PanelRefreshScheduler::countPartialRefresh(int x, int y, int width, int height)
+{
+    int firstColumn = max(0, x / REFRESH_TILE_SIZE);
+    int lastColumn = min(REFRESH_TILE_COLS - 1, (x + width - 1) / REFRESH_TILE_SIZE);
+    int firstRow = max(0, y / REFRESH_TILE_SIZE);
+    int lastRow = min(REFRESH_TILE_ROWS - 1, (y + height - 1) / REFRESH_TILE_SIZE);
+    for (int row = firstRow; row <= lastRow; row++)
+    {
+        for (int column = firstColumn; column <= lastColumn; column++)
+        {
+            if (partialRefreshes[row][column] < UINT8_MAX)
+            {
+                partialRefreshes[row][column]++;
+            }
+        }
+    }
+}
+
+// Batched refreshes
+
+void M5PanelRefreshScheduler::add(int x, int y, int width, int height, M5PanelContent content)
+{
+    if (!dirty)
+    {
+        dirty = true;
+        firstDirtyMillis = millis();
+        left = x;
+        top = y;
+        right = x + width;
+        bottom = y + height;
+        dirtyContent = content;
+        return;
+    }
+
+    // the controller refreshes one area at a time, so merge into the bounding box
+    left = min(left, x);
+    top = min(top, y);
+    right = max(right, x + width);
+    bottom = max(bottom, y + height);
+    if (content == M5PanelContent::Grayscale)
+    {
+        dirtyContent = content;
+    }
+}
+
+boolean M5PanelRefreshScheduler::pending()
+{
+    return dirty;
+}
+
+boolean M5PanelRefreshScheduler::flush(boolean force)
+{
+    if (!dirty || (!force && millis() - firstDirtyMillis < UPDATE_BATCH_WINDOW))
+    {
+        return false;
+    }
+
+    log_d("M5PanelRefreshScheduler: refreshing batch (%d,%d) to (%d,%d)", left, top, right, bottom);
+    dirty = false;
+    refresh(left, top, right - left, bottom - top, dirtyContent);
+    latency.eventsShown();
+    return true;
+}
+
+void M5PanelRefreshScheduler::clear()
+{
+    dirty = false;
+}
+
+// Ghosting cleanup
+
+void M5PanelRefreshScheduler::cleanupTiles(int row, int column, int *tileLeft, int *tileTop, int *tileRight, int *tileBottom)
+{
+    // flood fill over neighbouring ghosted tiles, collecting their bounding box
+    if (row < 0 || row >= REFRESH_TILE_ROWS || column < 0 || column >= REFRESH_TILE_COLS || partialRefreshes[row][column] < GHOSTING_LIMIT)
+    {
+        return;
+    }
+    partialRefreshes[row][column] = 0;
+    *tileLeft = min(*tileLeft, column);
+    *tileTop = min(*tileTop, row);
+    *tileRight = max(*tileRight, column);
+    *tileBottom = max(*tileBottom, row);
+
+    cleanupTiles(row - 1, column, tileLeft, tileTop, tileRight, tileBottom);
+    cleanupTiles(row + 1, column, tileLeft, tileTop, tileRight, tileBottom);
+    cleanupTiles(row, column - 1, tileLeft, tileTop, tileRight, tileBottom);
+    cleanupTiles(row, column + 1, tileLeft, tileTop, tileRight, tileBottom);
+}
+
+boolean M5PanelRefreshScheduler::cleanup()
+{
+    if (dirty || millis() - lastRefreshMillis < GHOSTING_CLEANUP_IDLE)
+    {
+        return false;
+    }
+
+    for (int row = 0; row < REFRESH_TILE_ROWS; row++)
+    {
+        for (int column = 0; column < REFRESH_TILE_COLS; column++)
+        {
+            if (partialRefreshes[row][column] < GHOSTING_LIMIT)
+            {
+                continue;
+            }
+            int tileLeft = column, tileTop = row, tileRight = column, tileBottom = row;
+            cleanupTiles(row, column, &tileLeft, &tileTop, &tileRight, &tileBottom);
+
+            int x = tileLeft * REFRESH_TILE_SIZE;
+            int y = tileTop * REFRESH_TILE_SIZE;
+            int width = (tileRight - tileLeft + 1) * REFRESH_TILE_SIZE;
+            int height = (tileBottom - tileTop + 1) * REFRESH_TILE_SIZE;
+            log_d("M5PanelRefreshScheduler: cleaning up ghosting in (%d,%d) to (%d,%d)", x, y, x + width, y + height);
+            M5.EPD.UpdateArea(x, y, width, height, UPDATE_MODE_GC16);
+            for (int cleanedRow = tileTop; cleanedRow <= tileBottom; cleanedRow++)
+            {
+                memset(partialRefreshes[cleanedRow] + tileLeft, 0, tileRight - tileLeft + 1);
+            }
+            lastRefreshMillis = millis();
+            // one region per call, so that new updates are not held up
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <Arduino.h>
+#include "defs.h"
+#include "M5PanelUI_LayoutConstants.h"
+
+// time to collect widget updates before refreshing the panel (ms)
+#ifndef UPDATE_BATCH_WINDOW
+#define UPDATE_BATCH_WINDOW 150
+#endif
+
+// partial refreshes of a region after which it gets cleaned up with GC16
+#ifndef GHOSTING_LIMIT
+#define GHOSTING_LIMIT 20
+#endif
+
+// time without refreshes before a ghosting cleanup is done (ms)
+#define GHOSTING_CLEANUP_IDLE 3000
+
+// size of the regions for which partial refreshes are counted
+#define REFRESH_TILE_SIZE 60
+#define REFRESH_TILE_COLS (PANEL_WIDTH / REFRESH_TILE_SIZE)
+#define REFRESH_TILE_ROWS (PANEL_HEIGHT / REFRESH_TILE_SIZE)
+
+enum class M5PanelContent
+{
+    /** black and white content (text, highlights), refreshed with the fast DU waveform */
+    Binary,
+    /** content with gray levels (icons, images), refreshed with GL16 */
+    Grayscale
+};
+
+/**
+ * Owns all refreshes of the e-paper panel: picks the waveform for the content of a region,
+ * batches widget updates into one refresh and cleans up regions that built up ghosting.
+ */
+class M5PanelRefreshScheduler
+{
+private:
+    uint8_t partialRefreshes[REFRESH_TILE_ROWS][REFRESH_TILE_COLS] = {};
+    unsigned long lastRefreshMillis = 0;
+
+    boolean dirty = false;
+    int left, top, right, bottom;
+    M5PanelContent dirtyContent;
+    unsigned long firstDirtyMillis;
+
+    void countPartialRefresh(int x, int y, int width, int height);
+    void cleanupTiles(int row, int column, int *tileLeft, int *tileTop, int *tileRight, int *tileBottom);
+
+public:
+    /** refresh an area that was rendered into the framebuffer */
+    void refresh(int x, int y, int width, int height, M5PanelContent content);
+
+    /** refresh the whole panel after a page was rendered, this removes all ghosting */
+    void refreshFull();
+
+    /** add a rendered area to the next batched refresh */
+    void add(int x, int y, int width, int height, M5PanelContent content);
+
+    boolean pending();
+
+    /** refresh the batched area once the batch window has passed (or immediately if forced) */
+    boolean flush(boolean force = false);
+
+    /** forget the batched area, e.g. because the whole panel gets refreshed */
+    void clear();
+
+    /** clean up regions with too many partial refreshes, only while the panel is idle */
+    boolean cleanup();
+};
+
+extern M5PanelRefreshScheduler refreshScheduler;
@@ -0,0 +1,332 @@
+#include "M5PanelSSEParser.h"
+
+M5PanelSSEParser::M5PanelSSEParser(M5PanelSSEHandler handler)
+{
+    this->handler = handler;
+    id[0] = '\0';
+    reset();
+}
+
+void M5PanelSSEParser::reset()
+{
+    httpState = HttpState::StatusLine;
+    chunked = false;
+    chunkRemaining = 0;
+    headerLength = 0;
+    previousWasCR = false;
+
+    lineState = LineState::Field;
+    field = Field::Other;
+    fieldLength = 0;
+    lineEmpty = true;
+
+    dataLength = 0;
+    hasData = false;
+    dataOverflow = false;
+    eventLength = 0;
+    pendingIdLength = 0;
+}
+
+boolean M5PanelSSEParser::finished()
+{
+    return httpState == HttpState::Finished;
+}
+
+const char *M5PanelSSEParser::lastEventId()
+{
+    return id;
+}
+
+void M5PanelSSEParser::process(Client &client)
+{
+    int available;
+    while ((available = client.available()) > 0)
+    {
+        int read = client.read((uint8_t *)readBuffer, min(available, SSE_READ_BUFFER_SIZE));
+        if (read <= 0)
+        {
+            break;
+        }
+        process(readBuffer, read);
+    }
+}
+
+void M5PanelSSEParser::process(const char *bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        processHttpByte(bytes[i]);
+    }
+}
+
+// HTTP framing
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+void M5PanelSSEParser::processHttpByte(char c)
+{
+    switch (httpState)
+    {
+    case HttpState::StatusLine:
+    case HttpState::Header:
+        if (c == '\r')
+        {
+            break;
+        }
+        if (c != '\n')
+        {
+            if (headerLength < SSE_HEADER_BUFFER_SIZE - 1)
+            {
+                headerLine[headerLength++] = tolower(c);
+            }
+            break;
+        }
+        headerLine[headerLength] = '\0';
+        if (httpState == HttpState::StatusLine)
+        {
+            if (strstr(headerLine, " 200") == NULL)
+            {
+                log_d("SSE: unexpected response %s", headerLine);
+                httpState = HttpState::Finished;
+                break;
+            }
+            httpState = HttpState::Header;
+        }
+        else if (headerLength == 0)
+        {
+            // empty line ends the header
+            httpState = chunked ? HttpState::ChunkSize : HttpState::Body;
+        }
+        else
+        {
+            processHeaderLine();
+        }
+        headerLength = 0;
+        break;
+    case HttpState::Body:
+        processEventByte(c);
+        break;
+    case HttpState::ChunkSize:
+    case HttpState::ChunkExtension:
+        if (c == '\n')
+        {
+            // a chunk of size 0 terminates the response
+            httpState = chunkRemaining == 0 ? HttpState::Finished : HttpState::ChunkData;
+        }
+        else if (httpState == HttpState::ChunkSize && hexValue(c) >= 0)
+        {
+            chunkRemaining = chunkRemaining * 16 + hexValue(c);
+        }
+        else if (c != '\r')
+        {
+            httpState = HttpState::ChunkExtension;
+        }
+        break;
+    case HttpState::ChunkData:
+        processEventByte(c);
+        if (--chunkRemaining == 0)
+        {
+            httpState = HttpState::ChunkDataEnd;
+        }
+        break;
+    case HttpState::ChunkDataEnd:
+        if (c == '\n')
+        {
+            httpState = HttpState::ChunkSize;
+        }
+        break;
+    case HttpState::Finished:
+        break;
+    }
+}
+
+void M5PanelSSEParser::processHeaderLine()
+{
+    // header line is stored in lower case
+    const char *transferEncoding = "transfer-encoding:";
+    if (strncmp(headerLine, transferEncoding, strlen(transferEncoding)) == 0 && strstr(headerLine, "chunked") != NULL)
+    {
+        chunked = true;
+    }
+}
+
+// Event stream
+
+void M5PanelSSEParser::processEventByte(char c)
+{
+    // lines end with CR, LF or CRLF
+    if (c == '\n' && previousWasCR)
+    {
+        previousWasCR = false;
+        return;
+    }
+    previousWasCR = c == '\r';
+    if (c == '\r' || c == '\n')
+    {
+        processEventLineEnd();
+        return;
+    }
+
+    lineEmpty = false;
+    switch (lineState)
+    {
+    case LineState::Field:
+        if (c == ':')
+        {
+            if (fieldLength == 0)
+            {
+                // comment line (used by openHAB as keep-alive)
+                lineState = LineState::Ignore;
+            }
+            else
+            {
+                selectField();
+                lineState = LineState::ValueStart;
+            }
+        }
+        else if (fieldLength < SSE_FIELD_BUFFER_SIZE - 1)
+        {
+            fieldName[fieldLength++] = c;
+        }
+        else
+        {
+            // field name too long for any known field
+            fieldLength = SSE_FIELD_BUFFER_SIZE;
+        }
+        break;
+    case LineState::ValueStart:
+        lineState = LineState::Value;
+        if (c != ' ')
+        {
+            appendValue(c);
+        }
+        break;
+    case LineState::Value:
+        appendValue(c);
+        break;
+    case LineState::Ignore:
+        break;
+    }
+}
+
+void M5PanelSSEParser::selectField()
+{
+    field = Field::Other;
+    if (fieldLength >= SSE_FIELD_BUFFER_SIZE)
+    {
+        return;
+    }
+    fieldName[fieldLength] = '\0';
+
+    if (strcmp(fieldName, "data") == 0)
+    {
+        field = Field::Data;
+        // multiple data lines are joined by line feeds
+        if (hasData)
+        {
+            appendValue('\n');
+        }
+        hasData = true;
+    }
+    else if (strcmp(fieldName, "event") == 0)
+    {
+        field = Field::Event;
+        eventLength = 0;
+    }
+    else if (strcmp(fieldName, "id") == 0)
+    {
+        field = Field::Id;
+        pendingIdLength = 0;
+    }
+}
+
+void M5PanelSSEParser::appendValue(char c)
+{
+    switch (field)
+    {
+    case Field::Data:
+        if (dataLength < SSE_DATA_BUFFER_SIZE - 1)
+        {
+            data[dataLength++] = c;
+        }
+        else
+        {
+            dataOverflow = true;
+        }
+        break;
+    case Field::Event:
+        if (eventLength < SSE_EVENT_BUFFER_SIZE - 1)
+        {
+            event[eventLength++] = c;
+        }
+        break;
+    case Field::Id:
+        if (pendingIdLength < SSE_ID_BUFFER_SIZE - 1)
+        {
+            pendingId[pendingIdLength++] = c;
+        }
+        break;
+    case Field::Other:
+        break;
+    }
+}
+
+void M5PanelSSEParser::processEventLineEnd()
+{
+    if (lineEmpty)
+    {
+        dispatch();
+    }
+    else
+    {
+        if (lineState == LineState::Field)
+        {
+            // line without colon: field name only, empty value
+            selectField();
+        }
+        if (field == Field::Id)
+        {
+            memcpy(id, pendingId, pendingIdLength);
+            id[pendingIdLength] = '\0';
+        }
+    }
+
+    lineState = LineState::Field;
+    field = Field::Other;
+    fieldLength = 0;
+    lineEmpty = true;
+}
+
+void M5PanelSSEParser::dispatch()
+{
+    if (hasData && dataOverflow)
+    {
+        log_d("SSE: dropping event exceeding %d bytes", SSE_DATA_BUFFER_SIZE);
+    }
+    else if (hasData)
+    {
+        data[dataLength] = '\0';
+        event[eventLength] = '\0';
+        handler(eventLength == 0 ? "message" : event, data, dataLength);
+    }
+
+    dataLength = 0;
+    hasData = false;
+    dataOverflow = false;
+    eventLength = 0;
+}
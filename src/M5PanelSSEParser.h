@@ -0,0 +1,108 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Client.h>
+
+// payload of one event (all data lines joined), events exceeding it are dropped
+#define SSE_DATA_BUFFER_SIZE 8192
+#define SSE_EVENT_BUFFER_SIZE 32
+#define SSE_ID_BUFFER_SIZE 64
+#define SSE_FIELD_BUFFER_SIZE 8
+// header lines are only inspected for the transfer encoding, longer lines are truncated
+#define SSE_HEADER_BUFFER_SIZE 64
+#define SSE_READ_BUFFER_SIZE 512
+
+/**
+ * handler for a complete event, data is a view into the parser buffer that is valid until the handler returns
+ */
+typedef void (*M5PanelSSEHandler)(const char *event, const char *data, size_t length);
+
+/**
+ * Incremental parser for a server-sent event stream including its HTTP response header.
+ * Decodes chunked transfer encoding and works on fixed buffers only, so that
+ * partial reads can be fed as they arrive without allocating memory.
+ */
+class M5PanelSSEParser
+{
+private:
+    enum class HttpState
+    {
+        StatusLine,
+        Header,
+        Body,
+        ChunkSize,
+        ChunkExtension,
+        ChunkData,
+        ChunkDataEnd,
+        Finished
+    };
+
+    enum class LineState
+    {
+        Field,
+        ValueStart,
+        Value,
+        Ignore
+    };
+
+    enum class Field
+    {
+        Data,
+        Event,
+        Id,
+        Other
+    };
+
+    M5PanelSSEHandler handler;
+
+    HttpState httpState;
+    boolean chunked;
+    size_t chunkRemaining;
+    char headerLine[SSE_HEADER_BUFFER_SIZE];
+    size_t headerLength;
+    boolean previousWasCR;
+
+    LineState lineState;
+    Field field;
+    char fieldName[SSE_FIELD_BUFFER_SIZE];
+    size_t fieldLength;
+    boolean lineEmpty;
+
+    char data[SSE_DATA_BUFFER_SIZE];
+    size_t dataLength;
+    boolean hasData;
+    boolean dataOverflow;
+    char event[SSE_EVENT_BUFFER_SIZE];
+    size_t eventLength;
+    char id[SSE_ID_BUFFER_SIZE];
+    char pendingId[SSE_ID_BUFFER_SIZE];
+    size_t pendingIdLength;
+
+    char readBuffer[SSE_READ_BUFFER_SIZE];
+
+    void processHttpByte(char c);
+    void processHeaderLine();
+    void processEventByte(char c);
+    void processEventLineEnd();
+    void selectField();
+    void appendValue(char c);
+    void dispatch();
+
+public:
+    M5PanelSSEParser(M5PanelSSEHandler handler);
+
+    /** prepare for a new connection, the next byte is expected to start the HTTP status line */
+    void reset();
+
+    /** feed raw bytes as received from the socket */
+    void process(const char *bytes, size_t length);
+
+    /** read and process everything currently available on client */
+    void process(Client &client);
+
+    /** true if the server ended the chunked response, the connection has to be re-established */
+    boolean finished();
+
+    /** id of the last dispatched event */
+    const char *lastEventId();
+};
@@ -0,0 +1,163 @@
+#include "M5PanelSitemapSnapshot.h"
+#include <LittleFS.h>
+#include "M5PanelUI.h"
+
+boolean saveSitemapSnapshot(JsonDocument &sitemap)
+{
+    File snapshot = LittleFS.open(SITEMAP_SNAPSHOT_FILE, "w", true);
+    if (!snapshot)
+    {
+        log_d("saveSitemapSnapshot: could not open %s", SITEMAP_SNAPSHOT_FILE);
+        return false;
+    }
+    size_t written = serializeMsgPack(sitemap, snapshot);
+    snapshot.close();
+    log_d("saveSitemapSnapshot: %d bytes written", written);
+    return written > 0;
+}
+
+boolean loadSitemapSnapshot(JsonDocument &sitemap)
+{
+    if (!LittleFS.exists(SITEMAP_SNAPSHOT_FILE))
+    {
+        return false;
+    }
+    File snapshot = LittleFS.open(SITEMAP_SNAPSHOT_FILE);
+    DeserializationError error = deserializeMsgPack(sitemap, snapshot, DeserializationOption::NestingLimit(50));
+    snapshot.close();
+    if (error)
+    {
+        log_d("loadSitemapSnapshot: %s", error.c_str());
+        sitemap.clear();
+        return false;
+    }
+    return !sitemap["homepage"].isNull();
+}
+
+boolean saveWidgetStates()
+{
+    File states = LittleFS.open(WIDGET_STATES_FILE, "w", true);
+    if (!states)
+    {
+        log_d("saveWidgetStates: could not open %s", WIDGET_STATES_FILE);
+        return false;
+    }
+    // identifier, label, state and item state of each widget, each terminated by '\0'
+    for (auto &indexed : M5PanelPage::widgetIndex)
+    {
+        M5PanelWidget &widget = indexed.second.element->widget;
+        const String *fields[] = {&indexed.first, &widget.label, &widget.state, &widget.itemState};
+        for (const String *field : fields)
+        {
+            states.write((const uint8_t *)field->c_str(), field->length() + 1);
+        }
+    }
+    states.close();
+    log_d("saveWidgetStates: %d widgets written", M5PanelPage::widgetIndex.size());
+    return true;
+}
+
+boolean loadWidgetStates()
+{
+    File states = LittleFS.open(WIDGET_STATES_FILE);
+    if (!states)
+    {
+        return false;
+    }
+    while (states.available())
+    {
+        String identifier = states.readStringUntil('\0');
+        String label = states.readStringUntil('\0');
+        String state = states.readStringUntil('\0');
+        String itemState = states.readStringUntil('\0');
+        auto found = M5PanelPage::widgetIndex.find(identifier);
+        if (found != M5PanelPage::widgetIndex.end())
+        {
+            found->second.element->updateStates(label, state, itemState);
+        }
+    }
+    states.close();
+    return true;
+}
+
+// Structure hash (FNV-1a)
+
+static uint32_t hashBytes(uint32_t hash, const char *bytes)
+{
+    for (const char *c = bytes; *c != '\0'; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    // separator, so that "ab","c" and "a","bc" differ
+    return (hash ^ 0xFF) * 16777619u;
+}
+
+static boolean isUpdatedField(const char *key, boolean widget, boolean item)
+{
+    if (widget)
+    {
+        return strcmp(key, "label") == 0 || strcmp(key, "state") == 0 || strcmp(key, "visibility") == 0;
+    }
+    return item && strcmp(key, "state") == 0;
+}
+
+static uint32_t hashSitemapStructure(JsonVariantConst json, uint32_t hash, boolean item)
+{
+    if (json.is<JsonObjectConst>())
+    {
+        JsonObjectConst object = json.as<JsonObjectConst>();
+        boolean widget = object.containsKey("widgetId");
+        hash = hashBytes(hash, "{");
+        for (JsonPairConst member : object)
+        {
+            const char *key = member.key().c_str();
+            if (isUpdatedField(key, widget, item))
+            {
+                continue;
+            }
+            hash = hashBytes(hash, key);
+            hash = hashSitemapStructure(member.value(), hash, widget && strcmp(key, "item") == 0);
+        }
+        return hashBytes(hash, "}");
+    }
+
+    if (json.is<JsonArrayConst>())
+    {
+        hash = hashBytes(hash, "[");
+        for (JsonVariantConst element : json.as<JsonArrayConst>())
+        {
+            hash = hashSitemapStructure(element, hash, false);
+        }
+        return hashBytes(hash, "]");
+    }
+
+    if (json.is<const char *>())
+    {
+        return hashBytes(hash, json.as<const char *>());
+    }
+
+    char value[32];
+    serializeJson(json, value, sizeof(value));
+    return hashBytes(hash, value);
+}
+
+uint32_t hashSitemapStructure(JsonVariantConst json)
+{
+    return hashSitemapStructure(json, 2166136261u, false);
+}
+
+uint32_t hashWidgetStructure(JsonObjectConst widget)
+{
+    uint32_t hash = 2166136261u;
+    for (JsonPairConst member : widget)
+    {
+        const char *key = member.key().c_str();
+        if (isUpdatedField(key, true, false) || strcmp(key, "widgets") == 0 || strcmp(key, "linkedPage") == 0)
+        {
+            continue;
+        }
+        hash = hashBytes(hash, key);
+        hash = hashSitemapStructure(member.value(), hash, strcmp(key, "item") == 0);
+    }
+    return hash;
+}
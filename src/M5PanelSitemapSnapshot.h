@@ -0,0 +1,29 @@
+#pragma once
+
+#include <ArduinoJson.h>
+
+#define SITEMAP_SNAPSHOT_FILE "/sitemapSnapshot"
+#define WIDGET_STATES_FILE "/widgetStates"
+
+/** store the sitemap document as MessagePack for restoring it on the next wake */
+boolean saveSitemapSnapshot(JsonDocument &sitemap);
+
+/** read the sitemap document stored by saveSitemapSnapshot */
+boolean loadSitemapSnapshot(JsonDocument &sitemap);
+
+/**
+ * store label and states of all widgets in the tree, the snapshot only holds the states of its download
+ */
+boolean saveWidgetStates();
+
+/** apply the widget states stored by saveWidgetStates to the tree, without drawing */
+boolean loadWidgetStates();
+
+/**
+ * hash over the sitemap without the widget fields that subscription updates change (label, state, visibility),
+ * two sitemaps with the same hash build the same page tree
+ */
+uint32_t hashSitemapStructure(JsonVariantConst json);
+
+/** structure hash of a single widget without its child widgets and linked page */
+uint32_t hashWidgetStructure(JsonObjectConst widget);
@@ -0,0 +1,138 @@
+#include "M5PanelTouch.h"
+#include <M5EPD.h>
+
+M5PanelTouch touch;
+
+void M5PanelTouch::begin()
+{
+    events = xQueueCreate(TOUCH_EVENT_QUEUE_LENGTH, sizeof(M5PanelTouchEvent));
+    // M5.begin attached M5EPD's handler to TOUCH_INT_PIN, a pin takes only one handler
+    xTaskCreatePinnedToCore(driverLoop, "touchDriver", 3072, this, 3, NULL, 1);
+}
+
+void M5PanelTouch::driverLoop(void *pvParameters)
+{
+    M5PanelTouch *touch = (M5PanelTouch *)pvParameters;
+    while (true)
+    {
+        touch->readController();
+        vTaskDelay(TOUCH_POLL_INTERVAL / portTICK_PERIOD_MS);
+    }
+}
+
+void M5PanelTouch::readController()
+{
+    // flag set by the interrupt handler, the controller is read over I2C only after it
+    if (!M5.TP.avaliable())
+    {
+        return;
+    }
+    M5.TP.update();
+    if (M5.TP.isFingerUp())
+    {
+        if (fingerDown)
+        {
+            fingerDown = false;
+            push(M5PanelTouchType::Up, fingerX, fingerY);
+        }
+    }
+    else
+    {
+        fingerX = M5.TP.readFingerX(0);
+        fingerY = M5.TP.readFingerY(0);
+        push(fingerDown ? M5PanelTouchType::Move : M5PanelTouchType::Down, fingerX, fingerY);
+        fingerDown = true;
+    }
+    M5.TP.flush();
+}
+
+void M5PanelTouch::push(M5PanelTouchType type, uint16_t x, uint16_t y)
+{
+    // within TOUCH_POLL_INTERVAL of the interrupt
+    M5PanelTouchEvent event = {type, x, y, millis()};
+    portENTER_CRITICAL(&moveLock);
+    // a drag reports on every scan, only its latest position matters; down and up carry their own
+    movePending = type == M5PanelTouchType::Move;
+    pendingMove = event;
+    portEXIT_CRITICAL(&moveLock);
+    if (type == M5PanelTouchType::Move)
+    {
+        return;
+    }
+
+    // losing a finger up loses the whole gesture, wait for the interaction task instead
+    if (xQueueSend(events, &event, 0) != pdTRUE)
+    {
+        log_d("push: touch event queue full, waiting");
+        xQueueSend(events, &event, portMAX_DELAY);
+    }
+}
+
+M5PanelGesture M5PanelTouch::nextGesture(unsigned long wait)
+{
+    M5PanelTouchEvent event;
+    if (xQueueReceive(events, &event, (pressed ? min(wait, (unsigned long)TOUCH_HOLD_CHECK) : wait) / portTICK_PERIOD_MS) == pdTRUE)
+    {
+        return recognize(event);
+    }
+
+    portENTER_CRITICAL(&moveLock);
+    boolean hasMove = movePending;
+    event = pendingMove;
+    movePending = false;
+    portEXIT_CRITICAL(&moveLock);
+    if (hasMove)
+    {
+        recognize(event);
+    }
+
+    // a finger resting long enough is a long press, reported without waiting for it to be lifted
+    int moved = max(abs((int)last.x - (int)down.x), abs((int)last.y - (int)down.y));
+    if (pressed && !longPressed && moved < GESTURE_SWIPE_DISTANCE / 2 && millis() - down.millis >= GESTURE_LONG_PRESS_TIME)
+    {
+        longPressed = true;
+        return {M5PanelGestureType::LongPress, down.x, down.y, down.x, down.y, millis()};
+    }
+    return {M5PanelGestureType::None, 0, 0, 0, 0};
+}
+
+M5PanelGesture M5PanelTouch::recognize(M5PanelTouchEvent &event)
+{
+    switch (event.type)
+    {
+    case M5PanelTouchType::Down:
+        pressed = true;
+        longPressed = false;
+        down = event;
+        last = event;
+        return {M5PanelGestureType::Press, event.x, event.y, event.x, event.y, event.millis};
+    case M5PanelTouchType::Move:
+        last = event;
+        return {M5PanelGestureType::None, 0, 0, 0, 0};
+    default:
+        break;
+    }
+
+    if (!pressed)
+    {
+        return {M5PanelGestureType::None, 0, 0, 0, 0};
+    }
+    pressed = false;
+
+    int dx = (int)event.x - (int)down.x;
+    int dy = (int)event.y - (int)down.y;
+    if (abs(dx) >= GESTURE_SWIPE_DISTANCE && abs(dx) >= abs(dy))
+    {
+        return {dx < 0 ? M5PanelGestureType::SwipeLeft : M5PanelGestureType::SwipeRight, down.x, down.y, event.x, event.y, event.millis};
+    }
+    if (abs(dy) >= GESTURE_SWIPE_DISTANCE)
+    {
+        return {dy < 0 ? M5PanelGestureType::SwipeUp : M5PanelGestureType::SwipeDown, down.x, down.y, event.x, event.y, event.millis};
+    }
+    if (longPressed)
+    {
+        // already reported while the finger was down
+        return {M5PanelGestureType::None, 0, 0, 0, 0};
+    }
+    return {M5PanelGestureType::Tap, down.x, down.y, event.x, event.y, event.millis};
+}
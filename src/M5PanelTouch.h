@@ -0,0 +1,111 @@
+#pragma once
+
+#include <Arduino.h>
+#include "defs.h"
+
+// interrupt line of the GT911 touch controller, also the wakeup source
+#define TOUCH_INT_PIN GPIO_NUM_36
+
+// check of the data flag set by the controller interrupt (ms)
+#define TOUCH_POLL_INTERVAL 10
+// check for a long press while a finger is down (ms)
+#define TOUCH_HOLD_CHECK 50
+
+// finger down and up events, moves are coalesced outside of the queue
+#define TOUCH_EVENT_QUEUE_LENGTH 16
+
+// minimal finger travel for a swipe (px)
+#ifndef GESTURE_SWIPE_DISTANCE
+#define GESTURE_SWIPE_DISTANCE 100
+#endif
+
+// time a finger has to rest for a long press (ms)
+#ifndef GESTURE_LONG_PRESS_TIME
+#define GESTURE_LONG_PRESS_TIME 600
+#endif
+
+enum class M5PanelTouchType
+{
+    Down,
+    Move,
+    Up
+};
+
+/** finger change reported by the controller, with the time it was read */
+struct M5PanelTouchEvent
+{
+    M5PanelTouchType type;
+    uint16_t x;
+    uint16_t y;
+    unsigned long millis;
+};
+
+enum class M5PanelGestureType
+{
+    None,
+    /** finger down, followed by one of the others */
+    Press,
+    Tap,
+    LongPress,
+    SwipeLeft,
+    SwipeRight,
+    SwipeUp,
+    SwipeDown
+};
+
+struct M5PanelGesture
+{
+    M5PanelGestureType type;
+    /** where the finger went down */
+    uint16_t x;
+    uint16_t y;
+    /** where the finger was lifted, for taps */
+    uint16_t releaseX;
+    uint16_t releaseY;
+    /** time of the touch event completing the gesture */
+    unsigned long millis;
+};
+
+/**
+ * Touch driver fed by the controller interrupt: M5EPD's handler for the interrupt line flags new data,
+ * a driver task reads the controller when the flag is set and queues touch events,
+ * the gesture layer turns them into taps, long presses and swipes.
+ */
+class M5PanelTouch
+{
+private:
+    QueueHandle_t events = NULL;
+
+    // controller state, used by the driver task
+    boolean fingerDown = false;
+    uint16_t fingerX = 0;
+    uint16_t fingerY = 0;
+
+    /** latest move not taken by nextGesture yet, guarded by moveLock */
+    boolean movePending = false;
+    M5PanelTouchEvent pendingMove;
+    portMUX_TYPE moveLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // gesture state, used by the task calling nextGesture
+    boolean pressed = false;
+    boolean longPressed = false;
+    M5PanelTouchEvent down;
+    M5PanelTouchEvent last;
+
+    static void driverLoop(void *pvParameters);
+    void readController();
+    void push(M5PanelTouchType type, uint16_t x, uint16_t y);
+    M5PanelGesture recognize(M5PanelTouchEvent &event);
+
+public:
+    /** start the driver task, after M5.begin attached the interrupt handler */
+    void begin();
+
+    /**
+     * wait up to wait ms for the next gesture, for less while a finger is down;
+     * returns a gesture of type None if none was completed
+     */
+    M5PanelGesture nextGesture(unsigned long wait);
+};
+
+extern M5PanelTouch touch;
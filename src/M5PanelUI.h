@@ -9,6 +9,14 @@
 // ELEMENT_ROWS * ELEMENT_COLS
 #define MAX_ELEMENTS 6
 
+// time after the last +/- tap from which updates with a different value replace the pending value (ms)
+#define PENDING_VALUE_TIMEOUT 10000
+
 // Utility functions
 
-String parseWidgetLabel(String label);
\ No newline at end of file
+String parseWidgetLabel(String label);
+
+/** json of the page shown when navigating into a widget, null if there is none */
+JsonObject getDetailJson(JsonObject json);
+/** keep the page json as source for building the page later, replacing the previous source */
+void storePageSource(JsonObject json, M5PanelPageSource *source);
@@ -1,57 +1,189 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include "M5PanelUI.h"
+#include "M5PanelSitemapSnapshot.h"
+#include "M5PanelPageCache.h"
 
 // M5PanelUIElement
 
-String getStateString(JsonObject json)
+static String stringOrEmpty(JsonVariant value)
+{
+    return value.isNull() ? "" : value.as<String>();
+}
+
+static float floatOr(JsonVariant value, float fallback)
+{
+    return value.isNull() ? fallback : value.as<String>().toFloat();
+}
+
+static void readOptions(JsonArray options, const char *commandKey, M5PanelWidgetOptions *target)
+{
+    target->clear();
+    for (JsonObject option : options)
+    {
+        String command = !option[commandKey].isNull() ? option[commandKey].as<String>() : stringOrEmpty(option["command"]);
+        target->push_back({command, stringOrEmpty(option["label"])});
+    }
+}
+
+/** take over everything but label and states from the widget json */
+static void readWidget(JsonObject json, M5PanelWidget *widget)
+{
+    JsonObject item = json["item"];
+    JsonObject stateDescription = item["stateDescription"];
+
+    widget->link = stringOrEmpty(item["link"]);
+    widget->minValue = floatOr(json["minValue"], floatOr(stateDescription["minimum"], 0));
+    widget->maxValue = floatOr(json["maxValue"], floatOr(stateDescription["maximum"], 100));
+    widget->step = floatOr(json["step"], floatOr(stateDescription["step"], 10));
+
+    // switches cycle through mappings, or else through the command options of the item
+    JsonArray mappings = json["mappings"];
+    boolean hasMappings = !mappings.isNull() && mappings.size() != 0;
+    readOptions(hasMappings ? mappings : item["commandDescription"]["commandOptions"].as<JsonArray>(), "command", &widget->commands);
+    // states are displayed with the label of their mapping or state option
+    readOptions(hasMappings ? mappings : stateDescription["options"].as<JsonArray>(), "value", &widget->stateLabels);
+
+    widget->structureHash = hashWidgetStructure(json);
+}
+
+/** state with its number replaced by the pending value, keeping the number format and the unit */
+static String getPendingStateString(String stateString, float pendingValue)
+{
+    int start = 0;
+    while (start < stateString.length() && !isDigit(stateString[start]) &&
+           !(stateString[start] == '-' && start + 1 < stateString.length() && isDigit(stateString[start + 1])))
+    {
+        start++;
+    }
+    if (start >= stateString.length())
+    {
+        return String(pendingValue, 1);
+    }
+
+    int end = start + 1;
+    int decimals = 0;
+    boolean fraction = false;
+    while (end < stateString.length() && (isDigit(stateString[end]) || (stateString[end] == '.' && !fraction)))
+    {
+        decimals += fraction ? 1 : 0;
+        fraction |= stateString[end] == '.';
+        end++;
+    }
+    return stateString.substring(0, start) + String(pendingValue, decimals) + stateString.substring(end);
+}
+
+static String getConfirmedStateString(M5PanelWidget *widget)
 {
     // get state from label
-    String label = json["label"];
-    int openingBracket = label.lastIndexOf('[');
-    int closingBracket = label.lastIndexOf(']');
+    int openingBracket = widget->label.lastIndexOf('[');
+    int closingBracket = widget->label.lastIndexOf(']');
     if (openingBracket != -1 && closingBracket != -1) // Value not found
     {
-        String value = label.substring(openingBracket + 1, closingBracket);
+        String value = widget->label.substring(openingBracket + 1, closingBracket);
         value.trim();
         return value;
     }
 
     // get state from item
-    JsonObject item = json["item"];
-    if (json["state"].isNull() && item["state"].isNull())
+    String stateString = widget->state != "" ? widget->state : widget->itemState;
+    for (M5PanelWidgetOption &option : widget->stateLabels)
     {
-        return "";
+        if (option.command == stateString)
+        {
+            // replace state value with label
+            return option.label;
+        }
     }
-    String stateString = json["state"].isNull() ? item["state"].as<String>() : json["state"].as<String>();
-    JsonObject stateDescription = item["stateDescription"];
-    JsonArray mappings = json["mappings"];
-    JsonArray options = mappings.isNull() || mappings.size() == 0 ? stateDescription["options"] : mappings;
-    if (!options.isNull())
+    return stateString;
+}
+
+static String getStateString(M5PanelWidget *widget)
+{
+    String stateString = getConfirmedStateString(widget);
+    return widget->pending ? getPendingStateString(stateString, widget->pendingValue) : stateString;
+}
+
+JsonObject getDetailJson(JsonObject json)
+{
+    // frames can have direct widgets, other items always seem to have a "linked page"
+    JsonArray widgets = json["widgets"];
+    return widgets.size() != 0 ? json : json["linkedPage"];
+}
+
+/** drop the evicted states of the widgets in json, the json is newer */
+static void forgetEvictedStates(JsonObject json)
+{
+    for (JsonObject widget : json["widgets"].as<JsonArray>())
     {
-        for (size_t i = 0; i < options.size(); i++)
+        if (!widget["widgetId"].isNull())
         {
-            JsonObject option = options[i];
-            String optionName = option["value"].isNull() ? option["command"].as<String>() : option["value"].as<String>();
-            if (optionName == stateString)
-            {
-                // replace state value with label
-                stateString = option["label"].as<String>();
-                break;
-            }
+            M5PanelPage::evictedStates.erase(widget["widgetId"].as<String>());
         }
+        forgetEvictedStates(widget);
+        forgetEvictedStates(widget["linkedPage"]);
     }
+}
 
-    return stateString;
+void storePageSource(JsonObject json, M5PanelPageSource *source)
+{
+    if (!M5PanelPage::evictedStates.empty())
+    {
+        forgetEvictedStates(json);
+    }
+    size_t size = json.isNull() ? 0 : measureMsgPack(json);
+    if (size != 0 && size == source->size && source->data != NULL)
+    {
+        // states of the same length, overwrite without going through the arena
+        serializeMsgPack(json, source->data, source->size);
+        return;
+    }
+
+    treeArena.release(source->data, source->size);
+    source->data = NULL;
+    source->size = 0;
+    if (json.isNull())
+    {
+        return;
+    }
+    source->size = size;
+    source->data = (uint8_t *)treeArena.tryAllocate(source->size);
+    if (source->data != NULL)
+    {
+        serializeMsgPack(json, source->data, source->size);
+    }
 }
 
-M5PanelUIElement::M5PanelUIElement(M5PanelPage *parent, JsonObject json)
+/** deserialize a page source into a document large enough for it */
+static boolean readPageSource(M5PanelPageSource *source, DynamicJsonDocument &json)
 {
-    this->json = json;
+    DeserializationError error = deserializeMsgPack(json, (const uint8_t *)source->data, source->size, DeserializationOption::NestingLimit(50));
+    if (error)
+    {
+        log_d("readPageSource: %s", error.c_str());
+        return false;
+    }
+    return true;
+}
+
+// strings are copied from the MessagePack source, they take about as much space as the members
+#define PAGE_SOURCE_DOCUMENT_SIZE(source) ((source).size * 4 + 1024)
 
+M5PanelUIElement::M5PanelUIElement(M5PanelPage *parent, JsonObject json)
+{
     this->parent = parent;
 
-    updateFromCurrentJson();
+    identifier = stringOrEmpty(json["widgetId"]);
+    icon = stringOrEmpty(json["icon"]);
+    readWidget(json, &widget);
+    updateStates(stringOrEmpty(json["label"]), stringOrEmpty(json["state"]), stringOrEmpty(json["item"]["state"]));
+    auto evicted = M5PanelPage::evictedStates.find(identifier);
+    if (evicted != M5PanelPage::evictedStates.end())
+    {
+        // built again after its page was evicted, the source is older than the states it had
+        updateStates(evicted->second.label, evicted->second.state, evicted->second.itemState);
+        M5PanelPage::evictedStates.erase(evicted);
+    }
 
     String typeString = json["type"];
     if (typeString == "Frame")
@@ -61,7 +193,7 @@ M5PanelUIElement::M5PanelUIElement(M5PanelPage *parent, JsonObject json)
     else if (typeString == "Selection")
     {
         type = M5PanelElementType::Selection;
-        choices = new M5PanelPage(json, this);
+        storePageSource(json, &choicesSource);
     }
     else if (typeString == "Setpoint")
     {
@@ -86,16 +218,8 @@ M5PanelUIElement::M5PanelUIElement(M5PanelPage *parent, JsonObject json)
 
     log_d("Initialized element: %s  with icon: %s state: %s type: %s", title.c_str(), icon.c_str(), state.c_str(), typeString.c_str());
 
-    // frames can have direct widgets, other items always seem to have a "linked page"
-    JsonArray widgets = json["widgets"];
-    JsonObject linkedPageJson = json["linkedPage"];
-    if (widgets.size() == 0 && linkedPageJson.isNull())
-    {
-        // we do not need a child element here
-        return;
-    }
-
-    detail = new M5PanelPage(this, widgets.size() != 0 ? json : linkedPageJson);
+    // pages behind the element are built when navigating or prerendering
+    storePageSource(getDetailJson(json), &detailSource);
 }
 
 M5PanelUIElement::M5PanelUIElement(M5PanelPage *parent, M5PanelUIElement *selection, JsonObject json, int i)
@@ -104,41 +228,182 @@ M5PanelUIElement::M5PanelUIElement(M5PanelPage *parent, M5PanelUIElement *select
 
     JsonArray choices = json["item"]["stateDescription"]["options"];
 
-    String value = choices[i]["value"].as<String>();
     String label = choices[i]["label"].as<String>();
 
     title = label;
     // TODO icon?
     identifier = selection->identifier + "_choice_" + i;
     type = M5PanelElementType::Choice;
-    this->json = json;
+
+    // touching the choice sends the command option with its label
+    widget.link = selection->widget.link;
+    for (JsonObject commandOption : json["item"]["commandDescription"]["commandOptions"].as<JsonArray>())
+    {
+        if (commandOption["label"] == label)
+        {
+            widget.commands.push_back({commandOption["command"].as<String>(), label});
+            break;
+        }
+    }
 }
 
 M5PanelUIElement::~M5PanelUIElement()
 {
     log_d("delete element %s (%s)", title.c_str(), identifier.c_str());
-    delete detail;
-    delete choices;
+    auto indexed = M5PanelPage::widgetIndex.find(identifier);
+    if (indexed != M5PanelPage::widgetIndex.end() && indexed->second.element == this)
+    {
+        M5PanelPage::widgetIndex.erase(indexed);
+    }
+    treeArena.release(detailSource.data, detailSource.size);
+    treeArena.release(choicesSource.data, choicesSource.size);
 }
 
-boolean M5PanelUIElement::updateFromCurrentJson()
+void *M5PanelUIElement::operator new(size_t size)
 {
-    boolean changed = false;
+    return treeArena.allocate(size);
+}
 
-    String newTitle = parseWidgetLabel(json["label"].as<String>()); // TODO if empty -> item label?
-    changed |= newTitle == title;
-    title = newTitle;
+void M5PanelUIElement::operator delete(void *element, size_t size)
+{
+    treeArena.release(element, size);
+}
+
+boolean M5PanelUIElement::hasDetail()
+{
+    return detail != NULL || detailSource.data != NULL;
+}
+
+M5PanelPage *M5PanelUIElement::getDetail()
+{
+    if (detail == NULL && detailSource.data != NULL)
+    {
+        DynamicJsonDocument json(PAGE_SOURCE_DOCUMENT_SIZE(detailSource));
+        if (!readPageSource(&detailSource, json))
+        {
+            return NULL;
+        }
+        String pageId = stringOrEmpty(json["id"]);
+        if (json["widgets"].isNull() && pageId != "")
+        {
+            // a page response links pages without their widgets, take them from the page fetched before
+            DynamicJsonDocument cached(PAGE_CACHE_DOCUMENT_SIZE);
+            if (loadCachedPage(pageId, cached))
+            {
+                log_d("getDetail: building detail page of %s from page cache", identifier.c_str());
+                detail = new M5PanelPage(this, cached.as<JsonObject>());
+                return detail;
+            }
+        }
+        log_d("getDetail: building detail page of %s", identifier.c_str());
+        detail = new M5PanelPage(this, json.as<JsonObject>());
+    }
+    return detail;
+}
+
+M5PanelPage *M5PanelUIElement::replaceDetail(JsonObject json)
+{
+    log_d("replaceDetail: rebuilding detail page of %s", identifier.c_str());
+    storePageSource(json, &detailSource);
+    M5PanelPage::destroy(detail);
+    detail = new M5PanelPage(this, json);
+    return detail;
+}
+
+M5PanelPage *M5PanelUIElement::getChoices()
+{
+    if (choices == NULL && choicesSource.data != NULL)
+    {
+        DynamicJsonDocument json(PAGE_SOURCE_DOCUMENT_SIZE(choicesSource));
+        if (readPageSource(&choicesSource, json))
+        {
+            log_d("getChoices: building choices page of %s", identifier.c_str());
+            choices = new M5PanelPage(json.as<JsonObject>(), this);
+        }
+    }
+    return choices;
+}
 
-    String newIcon = json["icon"].as<String>();
-    changed |= newIcon == icon;
-    icon = newIcon;
+/** remember the states of the widgets on page and the pages below it, see M5PanelPage::evictedStates */
+static void keepEvictedStates(M5PanelPage *page)
+{
+    std::vector<M5PanelPage *> pages;
+    if (page != NULL)
+    {
+        pages.push_back(page);
+    }
+    while (!pages.empty())
+    {
+        M5PanelPage *current = pages.back();
+        pages.pop_back();
+        if (current->next != NULL)
+        {
+            pages.push_back(current->next);
+        }
+        for (M5PanelUIElement *element : current->elements)
+        {
+            if (element == NULL)
+            {
+                continue;
+            }
+            if (element->identifier != "" && element->type != M5PanelElementType::Choice)
+            {
+                M5PanelPage::evictedStates[element->identifier] = {element->widget.label, element->widget.state, element->widget.itemState};
+            }
+            if (element->detail != NULL)
+            {
+                pages.push_back(element->detail);
+            }
+        }
+    }
+}
 
-    String newIdentifier = json["widgetId"].as<String>();
-    changed |= newIdentifier == identifier;
-    identifier = newIdentifier;
+void M5PanelUIElement::evictPages()
+{
+    keepEvictedStates(detail);
+    M5PanelPage::destroy(detail);
+    detail = NULL;
+    M5PanelPage::destroy(choices);
+    choices = NULL;
+}
+
+boolean M5PanelUIElement::updateStates(String label, String state, String itemState)
+{
+    widget.label = label;
+    widget.state = state;
+    widget.itemState = itemState;
+    widget.numericState = itemState.toFloat();
+    if (widget.pending && (fabs(widget.numericState - widget.pendingValue) < 0.001 || millis() - widget.pendingMillis > PENDING_VALUE_TIMEOUT))
+    {
+        widget.pending = false;
+    }
+    return updateFromWidget();
+}
+
+void M5PanelUIElement::setPendingValue(float value)
+{
+    widget.pending = true;
+    widget.pendingValue = value;
+    widget.pendingMillis = millis();
+    updateFromWidget();
+}
+
+void M5PanelUIElement::clearPendingValue()
+{
+    widget.pending = false;
+    updateFromWidget();
+}
+
+boolean M5PanelUIElement::updateFromWidget()
+{
+    boolean changed = false;
+
+    String newTitle = parseWidgetLabel(widget.label); // TODO if empty -> item label?
+    changed |= newTitle != title;
+    title = newTitle;
 
-    String newState = getStateString(json);
-    changed |= newState == state;
+    String newState = getStateString(&widget);
+    changed |= newState != state;
     state = newState;
 
     return changed;
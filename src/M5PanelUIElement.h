@@ -1,4 +1,8 @@
+#include <vector>
+#include "M5PanelArena.h"
+
 class M5PanelPage;
+enum class M5PanelContent;
 
 enum class M5PanelElementType
 {
@@ -11,6 +15,46 @@ enum class M5PanelElementType
     Text
 };
 
+/** option of a widget, from its mappings or the command / state description of its item */
+struct M5PanelWidgetOption
+{
+    String command;
+    String label;
+};
+
+typedef std::vector<M5PanelWidgetOption, M5PanelArenaAllocator<M5PanelWidgetOption>> M5PanelWidgetOptions;
+
+/** the parts of the widget json an element works with, taken over when the element is built */
+struct M5PanelWidget
+{
+    String label;
+    /** state of the widget itself, empty if only the item has one */
+    String state;
+    String itemState;
+    float numericState = 0;
+    String link;
+    float minValue = 0;
+    float maxValue = 100;
+    float step = 10;
+    /** commands a switch cycles through, the command of a choice */
+    M5PanelWidgetOptions commands;
+    /** labels displayed instead of state values */
+    M5PanelWidgetOptions stateLabels;
+    /** hashWidgetStructure of the widget json, for reconciling */
+    uint32_t structureHash = 0;
+    /** value of +/- taps that is displayed until an update confirms it */
+    boolean pending = false;
+    float pendingValue = 0;
+    unsigned long pendingMillis = 0;
+};
+
+/** json of a page that is built on first use, as MessagePack in treeArena */
+struct M5PanelPageSource
+{
+    uint8_t *data = NULL;
+    size_t size = 0;
+};
+
 class M5PanelUIElement
 {
 private:
@@ -18,17 +62,21 @@ private:
     void drawTitle(M5EPD_Canvas *canvas, int size);
     void drawIcon(M5EPD_Canvas *canvas, int size);
     void drawStatusAndControlArea(M5EPD_Canvas *canvas, int size);
-    boolean updateFromCurrentJson();
+    boolean updateFromWidget();
+
 
 public:
-    JsonObject json;
+    M5PanelWidget widget;
     M5PanelElementType type;
     String title;
     String icon;
     String state;
     M5PanelPage *parent = NULL;
+    /** detail and choices pages once built, see getDetail and getChoices */
     M5PanelPage *detail = NULL;
     M5PanelPage *choices = NULL;
+    M5PanelPageSource detailSource;
+    M5PanelPageSource choicesSource;
 
     String identifier = "";
 
@@ -37,10 +85,48 @@ public:
     M5PanelUIElement(M5PanelPage *parent, M5PanelUIElement *selection, JsonObject json, int i);
     ~M5PanelUIElement();
 
+    /** elements are allocated from treeArena, like pages */
+    static void *operator new(size_t size);
+    static void operator delete(void *element, size_t size);
+    /** delete the element with its detail and choices pages, use instead of delete */
+    static void destroy(M5PanelUIElement *element);
+
+    boolean hasDetail();
+    /** detail page, built from its source on first use; NULL if there is none */
+    M5PanelPage *getDetail();
+    /** replace the detail page by one built from the fetched page json, see SITEMAP_PAGE_LOADING */
+    M5PanelPage *replaceDetail(JsonObject json);
+    /** choices page of a selection, built from its source on first use */
+    M5PanelPage *getChoices();
+    /** delete the built detail and choices pages, they are built again when used */
+    void evictPages();
+    /**
+     * take over the detail page json of the widget json as source if the detail page is not built,
+     * so that it is built with current states; returns false if it is built and has to be updated instead
+     */
+    boolean updateDetailSource(JsonObject newJson);
+
     boolean update(JsonObject json);
+    /** take over label and states as sent by subscription updates, true if the element changed */
+    boolean updateStates(String label, String state, String itemState);
+    /** display a value commanded by +/- taps before the item has it */
+    void setPendingValue(float value);
+    /** drop the pending value, e.g. when its command failed */
+    void clearPendingValue();
+    /** top of the area showing the state, relative to the element frame */
+    int valueAreaTop(int elementSize);
+    /**
+     * take over the widget json of a changed sitemap, keeping this element and its unchanged subpages;
+     * returns false if the widget changed too much and the element has to be replaced
+     */
+    boolean reconcile(JsonObject newJson);
 
     void draw(M5EPD_Canvas *canvas, int x, int y, int size);
+    uint32_t contentHash();
+    M5PanelContent getContent();
 
-    M5PanelPage *forwardTouch(String currentElement, uint16_t x, uint16_t y, M5EPD_Canvas *canvas);
-    M5PanelPage *processTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas, int *highlightX, int *highlightY, boolean (**callback)(M5PanelUIElement *));
+    /** area highlighted for a touch at (x, y), relative to the element area; false if the touch does nothing */
+    boolean getTouchArea(uint16_t x, uint16_t y, int *areaX, int *areaY, int *areaWidth, int *areaHeight);
+    /** react to a touch at (x, y) relative to the element area, returns the page to navigate to or NULL */
+    M5PanelPage *processTouch(uint16_t x, uint16_t y, boolean (**callback)(M5PanelUIElement *));
 };
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include "M5PanelUI_LayoutConstants.h"
 #include "ImageResource.h"
 #include "FontSizes.h"
+#include "M5PanelRefreshScheduler.h"
+#include "M5PanelGlyphCache.h"
 #include <M5EPD.h>
 
 void M5PanelStatusArea::startLoadingIndicator()
@@ -52,10 +54,9 @@ void M5PanelStatusArea::showBatteryIndicator(M5EPD_Canvas *canvas)
     sprintf(buf, "%d%%", (int)(battery * 100));
     canvas->fillRect(img_x + 3, img_y + 10, px, 13, 15);
 
-    canvas->setTextDatum(ML_DATUM);
-    canvas->setTextSize(FONT_SIZE_LABEL_SMALL);
-    canvas->drawString(buf, img_x + img_width + 5, img_y + img_height / 2);
-    canvas->pushCanvas(0, 500, UPDATE_MODE_GLD16);
+    glyphCache.drawString(canvas, buf, FONT_SIZE_LABEL_SMALL, ML_DATUM, img_x + img_width + 5, img_y + img_height / 2);
+    canvas->pushCanvas(0, 500, UPDATE_MODE_NONE);
+    refreshScheduler.refresh(0, 500, canvas->width(), canvas->height(), M5PanelContent::Grayscale);
 
     canvas->deleteCanvas();
 }
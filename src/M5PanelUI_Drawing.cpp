@@ -1,6 +1,10 @@
 #include "M5PanelUI.h"
 #include "M5PanelUI_LayoutConstants.h"
 #include "FontSizes.h"
+#include "M5PanelRefreshScheduler.h"
+#include "M5PanelIconCache.h"
+#include "M5PanelGlyphCache.h"
+#include "M5PanelPrerenderer.h"
 #include <LittleFS.h>
 
 // Graphic settings
@@ -24,7 +28,7 @@ void M5PanelUIElement::draw(M5EPD_Canvas *canvas, int x, int y, int size)
 
     drawStatusAndControlArea(canvas, elementSize);
 
-    canvas->pushCanvas(x + MARGIN, y + MARGIN, UPDATE_MODE_NONE);
+    M5PanelPage::present(canvas, x + MARGIN, y + MARGIN);
     canvas->deleteCanvas();
 }
 
@@ -39,7 +43,7 @@ void M5PanelUIElement::drawFrame(M5EPD_Canvas *canvas, int elementSize)
     canvas->fillRoundRect(innerRectStart, innerRectStart, innerRectSize, innerRectSize, innerRadius, 0);
 
     // detail page indicator
-    if (detail != NULL)
+    if (hasDetail())
     {
         int cornerStart = innerRectStart + innerRectSize - 30;
         canvas->fillRoundRect(cornerStart, innerRectStart, 30, 30, innerRadius, 15);
@@ -68,25 +72,7 @@ void M5PanelUIElement::drawTitle(M5EPD_Canvas *canvas, int elementSize)
         break;
     }
 
-    canvas->setTextSize(FONT_SIZE_LABEL);
-    canvas->setTextDatum(alignment);
-    canvas->drawString(title, elementCenter, titleY);
-}
-
-String getLocalIconFile(String icon, String state)
-{
-    String iconFile = "/icons/" + icon + "-" + state + ".png"; // Try to find dynamic icon ...
-    iconFile.toLowerCase();
-    if (!LittleFS.exists(iconFile))
-    {
-        iconFile = "/icons/" + icon + ".png"; // else try to find non dynamic icon
-        iconFile.toLowerCase();
-        if (!LittleFS.exists(iconFile))
-        {
-            iconFile = "";
-        }
-    }
-    return iconFile;
+    glyphCache.drawString(canvas, title, FONT_SIZE_LABEL, alignment, elementCenter, titleY);
 }
 
 void M5PanelUIElement::drawIcon(M5EPD_Canvas *canvas, int size)
@@ -96,28 +82,27 @@ void M5PanelUIElement::drawIcon(M5EPD_Canvas *canvas, int size)
         return;
     }
 
-    int iconSize = 96;
+    int iconSize = ICON_SIZE;
     int yOffset = iconSize / 2;
-    String iconFile = getLocalIconFile(icon, state);
-    if (iconFile != "")
-    {
-        canvas->drawPngFile(LittleFS, iconFile.c_str(), size / 2 - iconSize / 2, size / 2 - yOffset, 0, 0, 0, 0, 1);
-    }
-    else
+    if (!iconCache.draw(canvas, icon, state, size / 2 - iconSize / 2, size / 2 - yOffset))
     {
         icon = ""; // draw as if there was no icon defined
     }
 }
 
-void M5PanelUIElement::drawStatusAndControlArea(M5EPD_Canvas *canvas, int elementSize)
+int M5PanelUIElement::valueAreaTop(int elementSize)
 {
     boolean statusVerticallyCentered = icon == "" && type != M5PanelElementType::Choice && type != M5PanelElementType::Frame;
+    return statusVerticallyCentered ? elementSize / 2 - ELEMENT_CONTROL_HEIGHT / 2 : elementSize - ELEMENT_CONTROL_HEIGHT;
+}
 
+void M5PanelUIElement::drawStatusAndControlArea(M5EPD_Canvas *canvas, int elementSize)
+{
     int elementCenter = elementSize / 2;
     int controlY = elementSize - ELEMENT_CONTROL_HEIGHT;
     int controlYCenter = elementSize - ELEMENT_CONTROL_HEIGHT / 2;
 
-    int valueYCenter = statusVerticallyCentered ? elementSize / 2 : controlYCenter;
+    int valueYCenter = valueAreaTop(elementSize) + ELEMENT_CONTROL_HEIGHT / 2;
 
     // clear previous status content
     canvas->fillRect(MARGIN, valueYCenter - ELEMENT_CONTROL_HEIGHT / 2 + MARGIN, elementSize - 2 * MARGIN, ELEMENT_CONTROL_HEIGHT - 2 * MARGIN, 0);
@@ -128,11 +113,8 @@ void M5PanelUIElement::drawStatusAndControlArea(M5EPD_Canvas *canvas, int elemen
     case M5PanelElementType::Slider:
     case M5PanelElementType::Setpoint:
         // draw +/- symbols
-        canvas->setTextSize(FONT_SIZE_CONTROL);
-        canvas->setTextDatum(ML_DATUM);
-        canvas->drawString("-", MARGIN, controlYCenter);
-        canvas->setTextDatum(MR_DATUM);
-        canvas->drawString("+", elementSize - MARGIN, controlYCenter);
+        glyphCache.drawString(canvas, "-", FONT_SIZE_CONTROL, ML_DATUM, MARGIN, controlYCenter);
+        glyphCache.drawString(canvas, "+", FONT_SIZE_CONTROL, MR_DATUM, elementSize - MARGIN, controlYCenter);
         break;
     case M5PanelElementType::Selection:
         // draw dots to indicate selection
@@ -159,39 +141,116 @@ void M5PanelUIElement::drawStatusAndControlArea(M5EPD_Canvas *canvas, int elemen
     case M5PanelElementType::Switch:
     case M5PanelElementType::Text:
         // draw status
-        canvas->setTextSize(FONT_SIZE_LABEL);
-        canvas->setTextDatum(MC_DATUM);
-        canvas->drawString(state, elementCenter, valueYCenter);
+        glyphCache.drawString(canvas, state, FONT_SIZE_LABEL, MC_DATUM, elementCenter, valueYCenter);
         break;
     default:
         break;
     }
 }
 
+M5PanelContent M5PanelUIElement::getContent()
+{
+    // icons have gray levels, the rest is drawn in black and white
+    return icon == "" ? M5PanelContent::Binary : M5PanelContent::Grayscale;
+}
+
+uint32_t M5PanelUIElement::contentHash()
+{
+    return M5PanelStringHash()(title + '\n' + icon + '\n' + state + '\n' + (int)type + (hasDetail() ? "+" : "-"));
+}
+
 // Draw page
 
-boolean M5PanelPage::draw(String pageIdentifier, M5EPD_Canvas *canvas)
+M5PanelRenderedContent M5PanelPage::renderedContent = {0, {0, 0, 0, 0, 0, 0}};
+M5EPD_Canvas *M5PanelPage::renderTarget = NULL;
+M5PanelRenderedContent *M5PanelPage::renderTargetContent = &M5PanelPage::renderedContent;
+
+void M5PanelPage::present(M5EPD_Canvas *canvas, int x, int y)
+{
+    if (renderTarget == NULL)
+    {
+        canvas->pushCanvas(x, y, UPDATE_MODE_NONE);
+    }
+    else
+    {
+        // canvases are 4bpp with even widths, rows can be copied as they are
+        renderTarget->pushImage(x, y, canvas->width(), canvas->height(), (uint8_t *)canvas->frameBuffer());
+    }
+}
+
+uint32_t M5PanelPage::contentHash()
+{
+    return M5PanelStringHash()(identifier + '\n' + title + '\n' + numElements + (next != NULL ? "+" : "-") + (previous != NULL ? "+" : "-") + (parent != NULL ? "+" : "-"));
+}
+
+boolean M5PanelPage::drawChanged(M5EPD_Canvas *canvas, boolean panelMemoryCleared)
 {
-    if (identifier == pageIdentifier)
+    if (renderedContent.page != contentHash())
     {
-        draw(canvas);
-        return true;
+        return false;
     }
 
+    if (panelMemoryCleared)
+    {
+        // later refreshes of larger areas would blank what the panel still shows
+        drawNavigation(canvas);
+    }
     for (size_t i = 0; i < numElements; i++)
     {
-        M5PanelPage *detailPage = elements[i]->detail;
-        if (detailPage != NULL && detailPage->draw(pageIdentifier, canvas))
+        if (renderedContent.elements[i] != elements[i]->contentHash())
+        {
+            log_d("drawChanged: element %s changed", elements[i]->identifier.c_str());
+            drawElement(canvas, i, true);
+        }
+        else if (panelMemoryCleared)
         {
-            return true;
+            drawElement(canvas, i, false);
         }
     }
+    return true;
+}
+
+boolean M5PanelPage::prerender(M5EPD_Canvas *canvas, M5EPD_Canvas *target, M5PanelRenderedContent *content)
+{
+    boolean rendered = false;
+    renderTarget = target;
+    renderTargetContent = content;
 
-    return next == NULL ? false : next->draw(pageIdentifier, canvas);
+    if (content->page != contentHash())
+    {
+        target->fillCanvas(0);
+        drawNavigation(canvas);
+        for (size_t i = 0; i < numElements; i++)
+        {
+            drawElement(canvas, i, false);
+        }
+        content->page = contentHash();
+        rendered = true;
+    }
+    else
+    {
+        for (size_t i = 0; i < numElements; i++)
+        {
+            if (content->elements[i] != elements[i]->contentHash())
+            {
+                drawElement(canvas, i, false);
+                rendered = true;
+            }
+        }
+    }
+
+    renderTarget = NULL;
+    renderTargetContent = &renderedContent;
+    return rendered;
 }
 
 void M5PanelPage::draw(M5EPD_Canvas *canvas)
 {
+    if (prerenderer.show(this, canvas))
+    {
+        return;
+    }
+
     // clear
     M5.EPD.Clear(false);
 
@@ -203,30 +262,54 @@ void M5PanelPage::draw(M5EPD_Canvas *canvas)
         drawElement(canvas, i, false);
     }
 
-    M5.EPD.UpdateFull(UPDATE_MODE_GLD16);
+    refreshScheduler.refreshFull();
+
+    renderedContent.page = contentHash();
+}
+
+void M5PanelPage::getElementOrigin(int elementIndex, int *x, int *y)
+{
+    *y = MARGIN + (elementIndex / ELEMENT_COLS) * ELEMENT_AREA_SIZE;
+    *x = NAV_WIDTH + MARGIN + (elementIndex % ELEMENT_COLS) * ELEMENT_AREA_SIZE;
+}
+
+void M5PanelPage::drawElementBatched(M5EPD_Canvas *canvas, int elementIndex)
+{
+    int x, y;
+    getElementOrigin(elementIndex, &x, &y);
+    drawElement(canvas, elementIndex, false);
+    refreshScheduler.add(x, y, ELEMENT_AREA_SIZE, ELEMENT_AREA_SIZE, elements[elementIndex]->getContent());
 }
 
 void M5PanelPage::drawElement(M5EPD_Canvas *canvas, int elementIndex, boolean updateImmediately)
 {
-    int y = MARGIN + (elementIndex / ELEMENT_COLS) * ELEMENT_AREA_SIZE;
-    int x = NAV_WIDTH + MARGIN + (elementIndex % ELEMENT_COLS) * ELEMENT_AREA_SIZE;
+    int x, y;
+    getElementOrigin(elementIndex, &x, &y);
     elements[elementIndex]->draw(canvas, x, y, ELEMENT_AREA_SIZE);
+    renderTargetContent->elements[elementIndex] = elements[elementIndex]->contentHash();
     if (updateImmediately)
     {
-        M5.EPD.UpdateArea(x, y, ELEMENT_AREA_SIZE, ELEMENT_AREA_SIZE, UPDATE_MODE_DU);
+        refreshScheduler.refresh(x, y, ELEMENT_AREA_SIZE, ELEMENT_AREA_SIZE, elements[elementIndex]->getContent());
     }
 }
 
+void M5PanelPage::drawElementValue(M5EPD_Canvas *canvas, int elementIndex)
+{
+    int x, y;
+    getElementOrigin(elementIndex, &x, &y);
+    drawElement(canvas, elementIndex, false);
+    // only the value changed, it is refreshed down to the control row with the fast black and white waveform
+    int elementSize = ELEMENT_AREA_SIZE - 2 * MARGIN;
+    int top = elements[elementIndex]->valueAreaTop(elementSize);
+    refreshScheduler.refresh(x + MARGIN, y + MARGIN + top, elementSize, elementSize - top, M5PanelContent::Binary);
+}
+
 void M5PanelPage::drawNavigation(M5EPD_Canvas *canvas)
 {
     // page title
     canvas->createCanvas(NAV_WIDTH, NAV_MARGIN_TOP_BOTTOM);
-    canvas->setTextSize(FONT_SIZE_LABEL);
-    canvas->setTextArea(MARGIN, MARGIN, NAV_WIDTH, NAV_MARGIN_TOP_BOTTOM);
-    canvas->setTextWrap(true);
-    canvas->setTextColor(15);
-    canvas->println(title);
-    canvas->pushCanvas(MARGIN, MARGIN, UPDATE_MODE_NONE);
+    glyphCache.drawWrapped(canvas, title, FONT_SIZE_LABEL, MARGIN, MARGIN, NAV_WIDTH - MARGIN);
+    present(canvas, MARGIN, MARGIN);
     canvas->deleteCanvas();
 
     // navigation arrows
@@ -263,6 +346,6 @@ void M5PanelPage::drawNavigation(M5EPD_Canvas *canvas)
     (canvas->*previous_triangle)(arrowMargin, secondArrowTop, arrowRight, secondArrowTop, arrowMiddle, secondArrowBottom, 15);
     (canvas->*back_triangle)(backArrowLeft, backArrowLeftY, backArrowRight, backArrowTop + 5, backArrowRight, backArrowBottom - 5, 15);
 
-    canvas->pushCanvas(0, NAV_MARGIN_TOP_BOTTOM, UPDATE_MODE_NONE);
+    present(canvas, 0, NAV_MARGIN_TOP_BOTTOM);
     canvas->deleteCanvas();
 }
\ No newline at end of file
@@ -1,224 +1,163 @@
 #include "M5PanelUI.h"
 #include "M5PanelUI_LayoutConstants.h"
 
-#include <HTTPClient.h>
+#include "M5PanelCommandQueue.h"
+#include "M5PanelRefreshScheduler.h"
+#include "M5PanelLatency.h"
 
 // Element touch processing
 
-M5PanelPage *M5PanelUIElement::forwardTouch(String currentElement, uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
+/** queue the command without waiting for it to be sent, false if it could not be queued */
+boolean postValue(M5PanelUIElement *element, String newState)
 {
-    if (choices != NULL)
-    {
-        M5PanelPage *newCurrentElement = choices->processTouch(currentElement, x, y, canvas);
-        if (newCurrentElement != NULL)
-        {
-            return newCurrentElement;
-        }
-    }
-
-    if (detail != NULL)
-    {
-        M5PanelPage *newCurrentElement = detail->processTouch(currentElement, x, y, canvas);
-        if (newCurrentElement != NULL)
-        {
-            return newCurrentElement;
-        }
-    }
-
-    // touch does not concern choices nor detail page of this item
-    return NULL;
-}
-
-void postValue(String link, String newState)
-{
-    log_d("Sending value %s", newState.c_str());
-    WiFiClient commandWifiClient;
-    HTTPClient httpPost;
-    httpPost.begin(commandWifiClient, link);
-    httpPost.addHeader(F("Content-Type"), F("text/plain"));
-    httpPost.POST(newState);
-    httpPost.end();
+    log_d("Queueing value %s", newState.c_str());
+    latency.commandQueued(element->identifier);
+    return commandQueue.send(element->identifier, element->widget.link, newState);
 }
 
 boolean sendChoiceTouch(M5PanelUIElement *touchedElement)
 {
     log_d("send touch on choice");
-    JsonObject json = touchedElement->json;
-    JsonArray choices = json["item"]["commandDescription"]["commandOptions"];
-    // find command for touched choice
-    for (size_t i = 0; i < choices.size(); i++)
+    // the command option with the label of the touched choice, if there is one
+    if (!touchedElement->widget.commands.empty())
     {
-        JsonObject choice = choices[i];
-        String touchedChoice = touchedElement->title;
-        if (choice["label"] == touchedChoice)
-        {
-            postValue(json["item"]["link"], choice["command"]);
-            return true;
-        }
+        // results are reported for the selection, the choices page is left anyway
+        postValue(touchedElement->parent->parent, touchedElement->widget.commands[0].command);
     }
     return true;
 }
 
-float getStep(JsonObject widgetJson, JsonObject stateDescription)
+/**
+ * taps accumulate on the pending value, which is displayed at once and sent when the taps settled;
+ * returns false as the value is redrawn instead of keeping the highlight
+ */
+boolean adjustValue(M5PanelUIElement *touchedElement, float delta)
 {
-    return !widgetJson["step"].isNull()
-               ? widgetJson["step"].as<String>().toFloat()
-               : (!stateDescription["step"].isNull()
-                      ? stateDescription["step"].as<String>().toFloat()
-                      : 10);
+    M5PanelWidget &widget = touchedElement->widget;
+    float value = widget.pending ? widget.pendingValue : widget.numericState;
+    float newValue = constrain(value + delta, widget.minValue, widget.maxValue);
+    if (newValue != value && commandQueue.sendSettled(touchedElement->identifier, widget.link, String(newValue)))
+    {
+        // the echo is measured from the last tap, the settle time is part of it
+        latency.commandQueued(touchedElement->identifier);
+        touchedElement->setPendingValue(newValue);
+    }
+    return false;
 }
 
 boolean sendPlusTouch(M5PanelUIElement *touchedElement)
 {
     log_d("send touch on plus");
-    JsonObject json = touchedElement->json;
-    float currentState = json["item"]["state"].as<String>().toFloat();
-    JsonObject stateDescription = json["item"]["stateDescription"];
-    float maxValue = !json["maxValue"].isNull()
-                         ? json["maxValue"].as<String>().toFloat()
-                         : (!stateDescription["minimum"].isNull()
-                                ? stateDescription["maximum"].as<String>().toFloat()
-                                : 100);
-    float step = getStep(json, stateDescription);
-    float newValue = min(maxValue, currentState + step);
-    postValue(json["item"]["link"], String(newValue));
-    return maxValue != currentState;
+    return adjustValue(touchedElement, touchedElement->widget.step);
 }
 
 boolean sendMinusTouch(M5PanelUIElement *touchedElement)
 {
     log_d("send touch on minus");
-    JsonObject json = touchedElement->json;
-    float currentState = json["item"]["state"].as<String>().toFloat();
-    JsonObject stateDescription = json["item"]["stateDescription"];
-    float minValue = !json["minValue"].isNull()
-                         ? json["minValue"].as<String>().toFloat()
-                         : (!stateDescription["minimum"].isNull()
-                                ? stateDescription["minimum"].as<String>().toFloat()
-                                : 0);
-    float step = getStep(json, stateDescription);
-    float newValue = max(minValue, currentState - step);
-    postValue(json["item"]["link"], String(newValue));
-    return minValue != currentState;
+    return adjustValue(touchedElement, -touchedElement->widget.step);
 }
 
 boolean sendSwitchTouch(M5PanelUIElement *touchedElement)
 {
     log_d("send touch on switch");
-    JsonObject json = touchedElement->json;
+    M5PanelWidget &widget = touchedElement->widget;
     // Decide how to process switch: Basic switches (without value mappings) get switched from "on" to "off", with value mappings switch one value further.
-    // TODO same for json["item"]["commandDescription"]["commandOptions"]
     String newState;
-    JsonArray mappings = json["mappings"];
-    if (mappings.isNull() || mappings.size() == 0)
-    {
-        mappings = json["item"]["commandDescription"]["commandOptions"];
-    }
-
-    if (mappings.isNull() || mappings.size() == 0)
+    if (widget.commands.empty())
     {
         newState = touchedElement->state == "ON" ? "OFF" : "ON";
     }
     else
     {
-        size_t nextStateIndex;
-        String itemState = json["item"]["state"];
+        // implicitly uses first state when current state not found
+        size_t nextStateIndex = 0;
         // find next state in mapping list
-        for (size_t i = 0; i < mappings.size(); i++)
+        for (size_t i = 0; i < widget.commands.size(); i++)
         {
-            JsonObject mapping = mappings[i];
-            if (mapping["command"] == itemState)
+            if (widget.commands[i].command == widget.itemState)
             {
-                nextStateIndex = (i + 1) % mappings.size();
+                nextStateIndex = (i + 1) % widget.commands.size();
                 break;
             }
         }
-        // implicitly uses first state when current state not found
-        newState = mappings[nextStateIndex]["command"].as<String>();
-        log_d("Current state: %s, new state: %s", itemState, newState);
+        newState = widget.commands[nextStateIndex].command;
+        log_d("Current state: %s, new state: %s", widget.itemState.c_str(), newState.c_str());
     }
-    postValue(json["item"]["link"], newState);
-    return true;
+    return postValue(touchedElement, newState);
 }
 
-M5PanelPage *M5PanelUIElement::processTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas, int *highlightX, int *highlightY, boolean (**callback)(M5PanelUIElement *))
+boolean M5PanelUIElement::getTouchArea(uint16_t x, uint16_t y, int *areaX, int *areaY, int *areaWidth, int *areaHeight)
 {
-    // process touch on title / icon or control area for interaction
-    log_d("Touched on item %s (title: %s) with coordinates (%d,%d) (relative to element frame)", identifier.c_str(), title.c_str(), x, y);
-
-    M5PanelPage *navigationTarget = NULL;
-
     int elementSize = ELEMENT_AREA_SIZE - 2 * MARGIN;
 
     if (type == M5PanelElementType::Frame || type == M5PanelElementType::Choice || type == M5PanelElementType::Text)
     {
-        // touched in area for navigation
-        if (detail != NULL)
-        {
-            navigationTarget = detail;
-        }
-        else if (type == M5PanelElementType::Choice)
-        {
-            // navigate back to parent page (parent of parent element of parent page)
-            *callback = &sendChoiceTouch;
-            navigationTarget = parent->parent->parent;
-        }
-        if (navigationTarget != NULL)
-        {
-            canvas->createCanvas(elementSize, elementSize);
-            canvas->fillRect(0, 0, elementSize, elementSize, 15);
-        }
-        else
+        // area for navigation, the whole element
+        if (!hasDetail() && type != M5PanelElementType::Choice)
         {
-            // we have to create a canvas to be drawn by the caller
-            canvas->createCanvas(1, 1);
+            return false;
         }
-        *highlightX = MARGIN;
-        *highlightY = MARGIN;
+        *areaX = MARGIN;
+        *areaY = MARGIN;
+        *areaWidth = elementSize;
+        *areaHeight = elementSize;
+        return true;
     }
-    else
+
+    // area for state / control
+    *areaY = elementSize - ELEMENT_CONTROL_HEIGHT + MARGIN;
+    *areaHeight = ELEMENT_CONTROL_HEIGHT;
+    switch (type)
+    {
+    case M5PanelElementType::Selection:
+    case M5PanelElementType::Switch:
+        *areaX = MARGIN;
+        *areaWidth = elementSize;
+        return true;
+    case M5PanelElementType::Setpoint:
+    case M5PanelElementType::Slider:
+        // - or +
+        *areaX = x < ELEMENT_AREA_SIZE / 2 ? MARGIN : elementSize / 2 + MARGIN;
+        *areaWidth = elementSize / 2;
+        return true;
+    default:
+        return false;
+    }
+}
+
+M5PanelPage *M5PanelUIElement::processTouch(uint16_t x, uint16_t y, boolean (**callback)(M5PanelUIElement *))
+{
+    // process touch on title / icon or control area for interaction
+    log_d("Touched on item %s (title: %s) with coordinates (%d,%d) (relative to element frame)", identifier.c_str(), title.c_str(), x, y);
+
+    switch (type)
     {
-        // touched in area for state / control
-        switch (type)
+    case M5PanelElementType::Frame:
+    case M5PanelElementType::Choice:
+    case M5PanelElementType::Text:
+        if (hasDetail())
         {
-        case M5PanelElementType::Selection:
-            canvas->createCanvas(elementSize, ELEMENT_CONTROL_HEIGHT);
-            *highlightY = elementSize - ELEMENT_CONTROL_HEIGHT + MARGIN;
-            *highlightX = MARGIN;
-            canvas->fillRect(0, 0, elementSize, ELEMENT_CONTROL_HEIGHT, 15);
-            navigationTarget = choices;
-            break;
-        case M5PanelElementType::Setpoint:
-        case M5PanelElementType::Slider:
-            canvas->createCanvas(elementSize / 2, ELEMENT_CONTROL_HEIGHT);
-            *highlightY = elementSize - ELEMENT_CONTROL_HEIGHT + MARGIN;
-            canvas->fillRect(0, 0, elementSize / 2, ELEMENT_CONTROL_HEIGHT, 15);
-            if (x < ELEMENT_AREA_SIZE / 2)
-            {
-                // touched -
-                *callback = &sendMinusTouch;
-                *highlightX = MARGIN;
-            }
-            else
-            {
-                *callback = &sendPlusTouch;
-                *highlightX = elementSize / 2 + MARGIN;
-            }
-            break;
-        case M5PanelElementType::Switch:
-            // touched switch
-            *callback = &sendSwitchTouch;
-            canvas->createCanvas(elementSize, ELEMENT_CONTROL_HEIGHT);
-            *highlightY = elementSize - ELEMENT_CONTROL_HEIGHT + MARGIN;
-            *highlightX = MARGIN;
-            canvas->fillRect(0, 0, elementSize, ELEMENT_CONTROL_HEIGHT, 15);
-            break;
-        default:
-            break;
+            return getDetail();
         }
+        if (type == M5PanelElementType::Choice)
+        {
+            // navigate back to parent page (parent of parent element of parent page)
+            *callback = &sendChoiceTouch;
+            return parent->parent->parent;
+        }
+        return NULL;
+    case M5PanelElementType::Selection:
+        return getChoices();
+    case M5PanelElementType::Setpoint:
+    case M5PanelElementType::Slider:
+        *callback = x < ELEMENT_AREA_SIZE / 2 ? &sendMinusTouch : &sendPlusTouch;
+        return NULL;
+    case M5PanelElementType::Switch:
+        *callback = &sendSwitchTouch;
+        return NULL;
+    default:
+        return NULL;
     }
-
-    return navigationTarget;
 }
 
 // Page touch processing
@@ -229,48 +168,146 @@ M5PanelPage *navigate(M5PanelPage *navigationTarget, M5EPD_Canvas *canvas)
     return navigationTarget;
 }
 
-M5PanelPage *M5PanelPage::processNavigationTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
+M5PanelPage *M5PanelPage::getArrowTarget(int arrow)
 {
-    log_d("Touched navigation area");
-    // touch within navigation area
-    int arrowAreaHeight = PANEL_HEIGHT - 2 * NAV_MARGIN_TOP_BOTTOM;
-    int singleArrowHeight = arrowAreaHeight / 3;
-
-    if (y > arrowAreaHeight)
-    {
-        return this; // not touched on arrows
-    }
-    int arrow = y / singleArrowHeight;
-    M5PanelPage *toDraw;
     switch (arrow)
     {
     case 0:
-        toDraw = next;
-        break;
+        return next;
     case 1:
-        toDraw = previous;
-        break;
+        return previous;
     case 2:
-        toDraw = parent == NULL ? NULL : parent->parent;
-        break;
+        return parent == NULL ? NULL : parent->parent;
     default:
-        toDraw = NULL;
+        return NULL;
     }
+}
 
-    if (toDraw == NULL)
+boolean M5PanelPage::getTouchTarget(uint16_t x, uint16_t y, M5PanelTouchTarget *target)
+{
+    if (x <= NAV_WIDTH)
     {
-        return this;
+        // touch within navigation area
+        int arrowAreaHeight = PANEL_HEIGHT - 2 * NAV_MARGIN_TOP_BOTTOM;
+        int singleArrowHeight = arrowAreaHeight / 3;
+        int arrowY = (int)y - NAV_MARGIN_TOP_BOTTOM;
+        if (arrowY < 0 || arrowY > arrowAreaHeight)
+        {
+            return false; // not touched on arrows
+        }
+        int arrow = arrowY / singleArrowHeight;
+        if (getArrowTarget(arrow) == NULL)
+        {
+            return false;
+        }
+        *target = {-1, arrow, 2 * MARGIN, NAV_MARGIN_TOP_BOTTOM + singleArrowHeight * arrow, NAV_WIDTH - 4 * MARGIN, singleArrowHeight};
+        return true;
+    }
+
+    int elementX = (int)x - NAV_WIDTH - MARGIN;
+    int elementY = (int)y - MARGIN;
+    if (elementX < 0 || elementY < 0)
+    {
+        return false;
+    }
+    int elementColumn = elementX / ELEMENT_AREA_SIZE;
+    int elementRow = elementY / ELEMENT_AREA_SIZE;
+    int elementIndex = elementColumn + (elementRow * ELEMENT_COLS);
+    if (elementColumn >= ELEMENT_COLS || elementRow >= ELEMENT_ROWS || elementIndex >= numElements)
+    {
+        return false;
+    }
+    int originX = elementColumn * ELEMENT_AREA_SIZE;
+    int originY = elementRow * ELEMENT_AREA_SIZE;
+    int areaX, areaY, areaWidth, areaHeight;
+    if (!elements[elementIndex]->getTouchArea(elementX - originX, elementY - originY, &areaX, &areaY, &areaWidth, &areaHeight))
+    {
+        return false;
+    }
+    *target = {elementIndex, 0, areaX + originX + NAV_WIDTH + MARGIN, areaY + originY + MARGIN, areaWidth, areaHeight};
+    return true;
+}
+
+boolean M5PanelPage::pressTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
+{
+    M5PanelTouchTarget target;
+    if (!getTouchTarget(x, y, &target))
+    {
+        return false;
+    }
+    // react to touch graphically while the finger is still down, the refresh overlaps with the touch
+    canvas->createCanvas(target.width, target.height);
+    canvas->fillCanvas(15);
+    canvas->pushCanvas(target.x, target.y, UPDATE_MODE_NONE);
+    refreshScheduler.refresh(target.x, target.y, target.width, target.height, M5PanelContent::Binary);
+    canvas->deleteCanvas();
+    return true;
+}
+
+void M5PanelPage::cancelTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
+{
+    M5PanelTouchTarget target;
+    if (!getTouchTarget(x, y, &target))
+    {
+        return;
+    }
+    // redraw to get rid of highlight
+    if (target.element >= 0)
+    {
+        drawElement(canvas, target.element, true);
     }
     else
     {
-        // highlight touched arrow
-        canvas->createCanvas(NAV_WIDTH - 4 * MARGIN, singleArrowHeight);
-        canvas->fillCanvas(15);
-        canvas->pushCanvas(2 * MARGIN, NAV_MARGIN_TOP_BOTTOM + singleArrowHeight * arrow, UPDATE_MODE_DU);
-        canvas->deleteCanvas();
+        drawNavigation(canvas);
+        refreshScheduler.refresh(0, NAV_MARGIN_TOP_BOTTOM, NAV_WIDTH, PANEL_HEIGHT - 2 * NAV_MARGIN_TOP_BOTTOM, M5PanelContent::Binary);
+    }
+}
+
+M5PanelPage *M5PanelPage::getNavigationTarget(uint16_t x, uint16_t y)
+{
+    M5PanelTouchTarget target;
+    if (!getTouchTarget(x, y, &target))
+    {
+        return NULL;
+    }
+    if (target.element < 0)
+    {
+        return getArrowTarget(target.arrow);
+    }
+    M5PanelUIElement *element = elements[target.element];
+    if (element->type == M5PanelElementType::Selection)
+    {
+        return element->getChoices();
+    }
+    // choices navigate back to the page of their selection, which is not fetched again
+    return element->hasDetail() ? element->getDetail() : NULL;
+}
 
-        return navigate(toDraw, canvas);
+M5PanelPage *M5PanelPage::releaseTouch(uint16_t pressX, uint16_t pressY, uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
+{
+    M5PanelTouchTarget pressed, released;
+    if (!getTouchTarget(pressX, pressY, &pressed))
+    {
+        return this;
     }
+    if (!getTouchTarget(x, y, &released) || released.element != pressed.element || released.arrow != pressed.arrow || released.x != pressed.x)
+    {
+        log_d("releaseTouch: finger slid off the touched target");
+        cancelTouch(pressX, pressY, canvas);
+        return this;
+    }
+    return processTouch(pressX, pressY, canvas);
+}
+
+M5PanelPage *M5PanelPage::processNavigationTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
+{
+    log_d("Touched navigation area");
+    M5PanelTouchTarget target;
+    if (!getTouchTarget(x, y, &target))
+    {
+        return this; // not touched on arrows
+    }
+    return navigate(getArrowTarget(target.arrow), canvas);
 }
 
 M5PanelPage *M5PanelPage::processElementTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
@@ -280,19 +317,21 @@ M5PanelPage *M5PanelPage::processElementTouch(uint16_t x, uint16_t y, M5EPD_Canv
     int elementIndex = elementColumn + (elementRow * ELEMENT_COLS);
     int originX = elementColumn * ELEMENT_AREA_SIZE;
     int originY = elementRow * ELEMENT_AREA_SIZE;
-    if (elementIndex < numElements)
+    if (elementColumn < ELEMENT_COLS && elementIndex < numElements)
     {
-        int highlightX, highlightY;
         boolean (*callback)(M5PanelUIElement *) = NULL;
         M5PanelUIElement *element = elements[elementIndex];
-        M5PanelPage *navigationTarget = element->processTouch(x - originX, y - originY, canvas, &highlightX, &highlightY, &callback);
-        // react to touch graphically to give immediate feedback, since no navigation occurred
-        canvas->pushCanvas(highlightX + originX + NAV_WIDTH + MARGIN, highlightY + originY + MARGIN, UPDATE_MODE_DU);
-        canvas->deleteCanvas();
+        // the highlight was drawn by pressTouch
+        M5PanelPage *navigationTarget = element->processTouch(x - originX, y - originY, &callback);
         if (callback != NULL)
         {
             boolean changed = callback(element);
-            if (!changed)
+            if (!changed && element->widget.pending)
+            {
+                // show the value of the taps so far, this also gets rid of the highlight
+                drawElementValue(canvas, elementIndex);
+            }
+            else if (!changed)
             {
                 // redraw to get rid of highlight
                 drawElement(canvas, elementIndex, true);
@@ -306,40 +345,14 @@ M5PanelPage *M5PanelPage::processElementTouch(uint16_t x, uint16_t y, M5EPD_Canv
     return this;
 }
 
-M5PanelPage *M5PanelPage::processTouch(String currentElement, uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
+M5PanelPage *M5PanelPage::processTouch(uint16_t x, uint16_t y, M5EPD_Canvas *canvas)
 {
-    if (currentElement == identifier)
+    if (x <= NAV_WIDTH)
     {
-        if (x <= NAV_WIDTH)
-        {
-            return processNavigationTouch(x, y - NAV_MARGIN_TOP_BOTTOM, canvas);
-        }
-        else
-        {
-            return processElementTouch(x - NAV_WIDTH - MARGIN, y - MARGIN, canvas);
-        }
+        return processNavigationTouch(x, y, canvas);
     }
     else
     {
-        // iterate through next pages and let them process the touch
-        M5PanelPage *newCurrentElement = NULL;
-        if (next != NULL)
-        {
-            newCurrentElement = next->processTouch(currentElement, x, y, canvas);
-        }
-        if (newCurrentElement != NULL)
-        {
-            return newCurrentElement;
-        }
-        // since none of the following pages could process the touch either, let child pages process it
-        for (size_t i = 0; i < numElements; i++)
-        {
-            newCurrentElement = elements[i]->forwardTouch(currentElement, x, y, canvas);
-            if (newCurrentElement != NULL)
-            {
-                return newCurrentElement;
-            }
-        }
-        return NULL;
+        return processElementTouch(x - NAV_WIDTH - MARGIN, y - MARGIN, canvas);
     }
 }
@@ -1,55 +1,67 @@
 #include "M5PanelUI.h"
+#include "M5PanelSitemapSnapshot.h"
+#include "M5PanelLatency.h"
 
 // Page update
 
-M5PanelPage *M5PanelPage::updateWidget(JsonObject json, String widgetId, String currentPage, M5EPD_Canvas *canvas)
+std::unordered_map<String, M5PanelWidgetLocation, M5PanelStringHash> M5PanelPage::widgetIndex;
+std::unordered_map<String, M5PanelPage *, M5PanelStringHash> M5PanelPage::pageRegistry;
+std::unordered_map<String, M5PanelWidgetStates, M5PanelStringHash> M5PanelPage::evictedStates;
+
+size_t M5PanelStringHash::operator()(const String &string) const
 {
-    for (size_t i = 0; i < numElements; i++)
+    // FNV-1a
+    size_t hash = 2166136261u;
+    for (const char *c = string.c_str(); *c != '\0'; c++)
     {
-        M5PanelUIElement *element = elements[i];
-        if (element->identifier != widgetId)
-        {
-            continue;
-        }
-        log_d("found widget to update: %s", widgetId.c_str());
-        //  update widget
-        boolean updated = elements[i]->update(json);
-
-        if (updated && currentPage == identifier)
-        {
-            log_d("redraw element %s", element->identifier.c_str());
-            //  redraw widget
-            drawElement(canvas, i, true);
-        }
-        // widget to update was found on this page
-        return this;
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
     }
+    return hash;
+}
 
-    // search subpages for element to be updated
-    for (size_t i = 0; i < numElements; i++)
+M5PanelPage *M5PanelPage::updateWidget(JsonObject json, String widgetId, M5PanelPage *currentPage, M5EPD_Canvas *canvas)
+{
+    auto found = widgetIndex.find(widgetId);
+    if (found == widgetIndex.end())
     {
-        M5PanelUIElement *element = elements[i];
-        // forward update command
-        if (element->detail != NULL)
+        // not built, but keep the states of a widget on an evicted page for building it again
+        auto evicted = evictedStates.find(widgetId);
+        if (evicted != evictedStates.end())
         {
-            log_d("Updating element %s detail", element->identifier.c_str());
-            M5PanelPage *foundOnPage = element->detail->updateWidget(json, widgetId, currentPage, canvas);
-            if (foundOnPage != NULL)
-            {
-                return foundOnPage;
-            }
+            evicted->second = {json["label"].isNull() ? "" : json["label"].as<String>(),
+                               json["state"].isNull() ? "" : json["state"].as<String>(),
+                               json["item"]["state"].isNull() ? "" : json["item"]["state"].as<String>()};
         }
+        return NULL;
     }
 
-    // not found on any of the subpages, search sibling page
-    if (next != NULL)
+    M5PanelWidgetLocation location = found->second;
+    log_d("found widget to update: %s", widgetId.c_str());
+    //  update widget
+    boolean updated = location.element->update(json);
+
+    if (updated && currentPage == location.page)
     {
-        log_d("Updating next page %s", next->identifier.c_str());
-        return next->updateWidget(json, widgetId, currentPage, canvas);
+        log_d("redraw element %s", widgetId.c_str());
+        //  redraw widget, the panel refresh is batched with other updates
+        location.page->drawElementBatched(canvas, location.slot);
+        latency.eventDrawn();
     }
+    return location.page;
+}
 
-    // not found at all in this branch
-    return NULL;
+void M5PanelPage::rollbackWidget(String widgetId, M5PanelPage *currentPage, M5EPD_Canvas *canvas)
+{
+    auto found = widgetIndex.find(widgetId);
+    if (found == widgetIndex.end())
+    {
+        return;
+    }
+    found->second.element->clearPendingValue();
+    if (found->second.page == currentPage)
+    {
+        currentPage->drawElementBatched(canvas, found->second.slot);
+    }
 }
 
 void M5PanelPage::updateAllWidgets(DynamicJsonDocument json)
@@ -60,18 +72,106 @@ void M5PanelPage::updateAllWidgets(DynamicJsonDocument json)
     }
 }
 
+boolean M5PanelPage::reconcile(JsonObject json)
+{
+    String widgetId = json["widgetId"].isNull() ? "" : json["widgetId"].as<String>();
+    String id = json["id"].isNull() ? "" : json["id"].as<String>();
+    JsonArray widgets = json["widgets"];
+    size_t pageOffset = pageIndex * MAX_ELEMENTS;
+    size_t newNumElements = widgets.size() > pageOffset ? min((size_t)MAX_ELEMENTS, widgets.size() - pageOffset) : 0;
+    boolean newHasNext = widgets.size() > pageOffset + MAX_ELEMENTS;
+    if (identifier != id + widgetId + "_" + pageIndex || newNumElements != numElements || newHasNext != (next != NULL))
+    {
+        return false;
+    }
+
+    String label = json["label"].isNull() ? "" : json["label"].as<String>();
+    String titleString = json["title"].isNull() ? "" : json["title"].as<String>();
+    title = parseWidgetLabel(label + titleString);
+
+    for (size_t i = 0; i < numElements; i++)
+    {
+        JsonObject elementJson = widgets[pageOffset + i];
+        if (elements[i]->reconcile(elementJson))
+        {
+            continue;
+        }
+        log_d("reconcile: replacing element %s", elements[i]->identifier.c_str());
+        M5PanelUIElement *replaced = elements[i];
+        elements[i] = new M5PanelUIElement(this, elementJson);
+        if (elements[i]->identifier != "")
+        {
+            widgetIndex[elements[i]->identifier] = {elements[i], this, i};
+        }
+        M5PanelUIElement::destroy(replaced);
+    }
+
+    if (next != NULL && !next->reconcile(json))
+    {
+        log_d("reconcile: rebuilding pages after %s", identifier.c_str());
+        M5PanelPage *replaced = next;
+        next = new M5PanelPage(parent, json, pageIndex + 1);
+        next->previous = this;
+        replaced->previous = NULL;
+        M5PanelPage::destroy(replaced);
+    }
+    return true;
+}
+
 // Element update
 
 boolean M5PanelUIElement::update(JsonObject newJson)
 {
-    // update contents of old json (the elements to update are derived from the BasicUI update function)
-    json["state"].set(newJson["state"]);
+    // the fields to update are derived from the BasicUI update function
+    return updateStates(newJson["label"].isNull() ? "" : newJson["label"].as<String>(),
+                        newJson["state"].isNull() ? "" : newJson["state"].as<String>(),
+                        newJson["item"]["state"].isNull() ? "" : newJson["item"]["state"].as<String>());
+}
 
-    json["item"]["state"].set(newJson["item"]["state"]);
+boolean M5PanelUIElement::updateDetailSource(JsonObject newJson)
+{
+    if (detail != NULL)
+    {
+        return false;
+    }
+    JsonObject detailJson = getDetailJson(newJson);
+    // like reconcile, a linked page without its widgets does not replace what is known of it
+    if (!detailJson.isNull() && !detailJson["widgets"].isNull())
+    {
+        storePageSource(detailJson, &detailSource);
+    }
+    return true;
+}
 
-    json["label"].set(newJson["label"]);
+boolean M5PanelUIElement::reconcile(JsonObject newJson)
+{
+    // widgetId, type, item and options have to match, label and state may differ;
+    // choice elements of a selection stay valid with its item and options
+    if (hashWidgetStructure(newJson) != widget.structureHash)
+    {
+        return false;
+    }
 
-    json["visibility"].set(newJson["visibility"]);
+    update(newJson);
 
-    return updateFromCurrentJson();
-}
\ No newline at end of file
+    JsonObject detailJson = getDetailJson(newJson);
+    if (!detailJson.isNull() && detailJson["widgets"].isNull() && hasDetail())
+    {
+        // page responses link pages without their widgets, keep what is known of them
+        return true;
+    }
+    // a detail page that is not built yet is built from the new source when used
+    storePageSource(detailJson, &detailSource);
+    if (detail != NULL && detailJson.isNull())
+    {
+        M5PanelPage::destroy(detail);
+        detail = NULL;
+    }
+    else if (detail != NULL && !detail->reconcile(detailJson))
+    {
+        log_d("reconcile: rebuilding detail page of %s", identifier.c_str());
+        M5PanelPage::destroy(detail);
+        detail = new M5PanelPage(this, detailJson);
+    }
+    return true;
+}
@@ -9,3 +9,7 @@
 #define OPENHAB_SITEMAP "m5panel" // Name of displayed sitemap
 
 #define SAMPLE_SITEMAP false
+// #define SITEMAP_PAGE_LOADING true // Fetch pages when shown instead of the whole sitemap, for large sitemaps
+
+// #define UPDATE_BATCH_WINDOW 150 // Time to collect widget updates into one panel refresh in milliseconds
+// #define PRERENDER_PAGES 6 // Pages around the current one kept rendered in PSRAM for instant navigation (253 KB each)
@@ -10,39 +10,75 @@
 #include "defs.h"
 #include "FontSizes.h"
 #include "M5PanelUIStatusArea.h"
+#include "M5PanelSSEParser.h"
+#include "M5PanelHttpConnection.h"
+#include "M5PanelSitemapSnapshot.h"
+#include "M5PanelRefreshScheduler.h"
+#include "M5PanelIconAtlas.h"
+#include "M5PanelIconCache.h"
+#include "M5PanelGlyphCache.h"
+#include "M5PanelPrerenderer.h"
+#include "M5PanelArena.h"
+#include "M5PanelPageCache.h"
+#include "M5PanelCommandQueue.h"
+#include "M5PanelTouch.h"
+#include "M5PanelPagePrefetcher.h"
+#include "M5PanelLatency.h"
 
 #define SAVED_STATE_FILE "/savedState"
+#define RENDERED_CONTENT_FILE "/renderedContent"
 #define TIME_UNTIL_SLEEP 120
 #define UPTIME_AUTOMATIC_BOOT 20
+// longest wait for a gesture before checking TIME_UNTIL_SLEEP (ms)
+#define INTERACTION_SLEEP_CHECK 1000
+// longest wait for the page change semaphore before a finger down goes without highlight (ms)
+#define PRESS_HIGHLIGHT_WAIT 20
 
 #define ERR_WIFI_NOT_CONNECTED "ERROR: Wifi not connected"
 #define ERR_HTTP_ERROR "ERROR: HTTP code "
 
-#define FONT_CACHE_SIZE 256
+// levels of widget nesting described by the sitemap filter, deeper levels are kept unfiltered
+#define SITEMAP_FILTER_DEPTH 4
+#define SITEMAP_FILTER_SIZE 24576
+// sitemap documents only live while the tree is built or revalidated
+#define SITEMAP_DOCUMENT_SIZE 60000
+// free memory below which built pages away from the current page are deleted again
+#define PAGE_EVICTION_FREE_HEAP (48 * 1024)
+#define PAGE_EVICTION_FREE_PSRAM (1024 * 1024)
+// wait after a failed prefetch before fetching linked pages again, in milliseconds
+#define PAGE_PREFETCH_RETRY 60000
+// longest wait for queued commands before going to sleep, in milliseconds
+#define COMMAND_SHUTDOWN_WAIT 5000
+// subscription events carry one widget with its item
+#define SUBSCRIPTION_EVENT_DOCUMENT_SIZE 16384
 
 // Global vars
 M5EPD_Canvas canvas(&M5.EPD);
 M5EPD_Canvas touchCanvas(&M5.EPD);
 
+M5PanelHttpConnection restConnection;
 WiFiClient subscribeClient;
+void onSubscriptionEvent(const char *event, const char *data, size_t length);
+M5PanelSSEParser subscriptionParser(&onSubscriptionEvent);
+// reused for every subscription event
+DynamicJsonDocument subscriptionEventJson(SUBSCRIPTION_EVENT_DOCUMENT_SIZE);
 
 String restUrl = "http://" + String(OPENHAB_HOST) + String(":") + String(OPENHAB_PORT) + String("/rest");
 String subscriptionId = "";
 
-DynamicJsonDocument jsonDoc(60000); // size to be checked
-
 M5PanelPage *rootPage = NULL;
-String currentPage = "" + String(OPENHAB_SITEMAP) + "_0";
+uint32_t sitemapStructureHash = 0;
+String currentPageIdentifier = "" + String(OPENHAB_SITEMAP) + "_0";
+M5PanelPage *currentPage = NULL;
 
 M5PanelStatusArea statusArea;
 
 #define PAGE_CHANGE_WAIT 10000
 SemaphoreHandle_t pageChangeSemaphore = xSemaphoreCreateBinary();
 
-unsigned long loopStartMillis = 0;
 long interactionStartMillis = 0;
-
-uint16_t _last_pos_x = 0xFFFF, _last_pos_y = 0xFFFF;
+// the controller memory was cleared on wake while the panel still shows the page from before sleep
+boolean panelMemoryCleared = false;
 
 Timezone openhabTZ;
 
@@ -61,14 +97,8 @@ Timezone openhabTZ;
 
 // HTTP and REST
 
-bool httpRequest(String &url, String &response)
+boolean checkWifiConnection()
 {
-    if (SAMPLE_SITEMAP)
-    {
-        return false;
-    }
-
-    log_d("httpRequest: HTTP request to %s", String(url).c_str());
     if (WiFi.status() != WL_CONNECTED)
     {
         log_d("reconnect wifi");
@@ -80,29 +110,150 @@ bool httpRequest(String &url, String &response)
         // attempted to reconnect but it did not work - give up.
         log_d("wifi not connected, abort request");
         log_d(ERR_WIFI_NOT_CONNECTED);
-        response = String(ERR_WIFI_NOT_CONNECTED);
         return false;
     }
+    return true;
+}
 
-    WiFiClient wifiClient;
-    HTTPClient httpClient;
+bool httpRequest(String &url, String &response)
+{
+    if (SAMPLE_SITEMAP)
+    {
+        return false;
+    }
 
-    httpClient.useHTTP10(true);
-    httpClient.begin(wifiClient, url);
-    int httpCode = httpClient.GET();
+    log_d("httpRequest: HTTP request to %s", String(url).c_str());
+    if (!checkWifiConnection())
+    {
+        response = String(ERR_WIFI_NOT_CONNECTED);
+        return false;
+    }
+
+    int httpCode = restConnection.GET(url);
     if (httpCode != HTTP_CODE_OK)
     {
         log_d("ERROR: HTTP code %d", httpCode);
         response = String(ERR_HTTP_ERROR) + String(httpCode);
-        httpClient.end();
+        restConnection.end();
         return false;
     }
-    response = httpClient.getString();
-    httpClient.end();
+    response = restConnection.getString();
+    restConnection.end();
     log_d("httpRequest: HTTP request done");
     return true;
 }
 
+// Sitemap JSON filter: keeps only the fields read by M5PanelPage / M5PanelUIElement
+
+void addSitemapWidgetFilter(JsonObject filter, int depth);
+
+void addSitemapPageFilter(JsonObject filter, int depth)
+{
+    filter["id"] = true;
+    filter["title"] = true;
+    addSitemapWidgetFilter(filter["widgets"].createNestedObject(), depth);
+}
+
+void addSitemapWidgetFilter(JsonObject filter, int depth)
+{
+    filter["widgetId"] = true;
+    filter["type"] = true;
+    filter["label"] = true;
+    filter["icon"] = true;
+    filter["state"] = true;
+    filter["visibility"] = true;
+    filter["step"] = true;
+    filter["minValue"] = true;
+    filter["maxValue"] = true;
+
+    JsonObject mapping = filter["mappings"].createNestedObject();
+    mapping["command"] = true;
+    mapping["value"] = true;
+    mapping["label"] = true;
+
+    JsonObject item = filter.createNestedObject("item");
+    item["link"] = true;
+    item["state"] = true;
+
+    JsonObject stateDescription = item.createNestedObject("stateDescription");
+    stateDescription["minimum"] = true;
+    stateDescription["maximum"] = true;
+    stateDescription["step"] = true;
+    JsonObject option = stateDescription["options"].createNestedObject();
+    option["value"] = true;
+    option["label"] = true;
+
+    JsonObject commandOption = item["commandDescription"]["commandOptions"].createNestedObject();
+    commandOption["command"] = true;
+    commandOption["label"] = true;
+
+    if (depth <= 0)
+    {
+        // filter can not describe arbitrarily deep sitemaps, keep everything below this level
+        filter["widgets"] = true;
+        filter["linkedPage"] = true;
+        return;
+    }
+
+    addSitemapWidgetFilter(filter["widgets"].createNestedObject(), depth - 1);
+    addSitemapPageFilter(filter.createNestedObject("linkedPage"), depth - 1);
+}
+
+void createSitemapFilter(JsonDocument &filter, boolean fullSitemap)
+{
+    // a full sitemap has its pages below "homepage", single pages are at the root
+    JsonObject pageFilter = fullSitemap ? filter.createNestedObject("homepage") : filter.to<JsonObject>();
+    addSitemapPageFilter(pageFilter, SITEMAP_FILTER_DEPTH);
+    if (filter.overflowed())
+    {
+        log_d("createSitemapFilter: filter document too small, increase SITEMAP_FILTER_SIZE");
+    }
+}
+
+bool deserializeSitemapJson(Stream &input, JsonDocument &doc, boolean fullSitemap)
+{
+    DynamicJsonDocument filter(SITEMAP_FILTER_SIZE);
+    createSitemapFilter(filter, fullSitemap);
+
+    DeserializationError error = deserializeJson(doc, input, DeserializationOption::Filter(filter), DeserializationOption::NestingLimit(50));
+    filter.clear();
+    if (error)
+    {
+        log_d("deserializeSitemapJson: %s", error.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * GET url and parse the response directly from the socket into doc, without buffering the response text
+ */
+bool httpRequestSitemapJson(String &url, JsonDocument &doc, boolean fullSitemap)
+{
+    if (SAMPLE_SITEMAP)
+    {
+        return false;
+    }
+
+    log_d("httpRequestSitemapJson: HTTP request to %s", String(url).c_str());
+    if (!checkWifiConnection())
+    {
+        return false;
+    }
+
+    int httpCode = restConnection.GET(url);
+    if (httpCode != HTTP_CODE_OK)
+    {
+        log_d("ERROR: HTTP code %d", httpCode);
+        restConnection.end();
+        return false;
+    }
+    bool parsed = deserializeSitemapJson(restConnection.getStream(), doc, fullSitemap);
+    restConnection.end();
+    log_d("httpRequestSitemapJson: HTTP request done");
+    return parsed;
+}
+
 String getSitemapPageId(String page)
 {
     int cutoffIdx = page.length() - 1;
@@ -123,40 +274,94 @@ String getSitemapPageId(String page)
 
 String getCurrentSitemapPageId()
 {
-    return getSitemapPageId(currentPage);
+    return getSitemapPageId(currentPageIdentifier);
 }
 
-DynamicJsonDocument subscribePage(String pageId)
+/** the page request that also moves the subscription to the page */
+String getSubscribePageUrl(String sitemapPageId)
 {
-    String sitemapPageId = getSitemapPageId(pageId);
-    String pageUpdate;
-    DynamicJsonDocument jsonData(60000);
-    if (httpRequest(restUrl + "/sitemaps/" + OPENHAB_SITEMAP + "/" + sitemapPageId + "?subscriptionid=" + subscriptionId, pageUpdate))
-    {
-        deserializeJson(jsonData, pageUpdate, DeserializationOption::NestingLimit(50));
-    }
-    return jsonData;
+    return restUrl + "/sitemaps/" + OPENHAB_SITEMAP + "/" + sitemapPageId + "?subscriptionid=" + subscriptionId;
+}
+
+bool fetchPage(String &url, JsonDocument &doc)
+{
+    return httpRequestSitemapJson(url, doc, false);
+}
+
+void buildSiteMap(JsonDocument &sitemap);
+void showCurrentPage();
+
+/** the root page as homepage of an otherwise empty sitemap, for building and snapshotting the tree from it */
+DynamicJsonDocument rootPageSitemap(JsonDocument &page)
+{
+    DynamicJsonDocument sitemap(page.memoryUsage() + 1024);
+    sitemap["homepage"] = page.as<JsonObject>();
+    return sitemap;
 }
 
-void updateAndSubscribePage(M5PanelPage *page)
+/**
+ * page loading: take over a page fetched from the page endpoint into the tree and the page cache;
+ * returns the page showing it afterwards, which differs from page if that had to be rebuilt
+ */
+M5PanelPage *applyFetchedPage(M5PanelPage *page, JsonDocument &json)
 {
-    DynamicJsonDocument jsonData = subscribePage(page->identifier);
+    String identifier = page->identifier;
+    String pageId = getSitemapPageId(identifier);
+    saveCachedPage(pageId, json);
 
-    if (jsonData.isNull())
+    // pagination pages are reconciled from the first page
+    M5PanelPage *first = page;
+    while (first->previous != NULL)
     {
-        return;
+        first = first->previous;
+    }
+    if (first->parent == NULL)
+    {
+        DynamicJsonDocument sitemap = rootPageSitemap(json);
+        saveSitemapSnapshot(sitemap);
+        if (treeArena.fragmented() || !first->reconcile(sitemap["homepage"]))
+        {
+            log_d("applyFetchedPage: root page changed, rebuilding");
+            buildSiteMap(sitemap);
+        }
+    }
+    else if (!first->reconcile(json.as<JsonObject>()))
+    {
+        first->parent->replaceDetail(json.as<JsonObject>());
     }
 
-    page->updateAllWidgets(jsonData);
-    jsonData.clear();
+    M5PanelPage *applied = M5PanelPage::find(identifier);
+    if (applied == NULL)
+    {
+        // the page has fewer pagination pages now
+        applied = M5PanelPage::find(pageId + "_0");
+    }
+    return applied != NULL ? applied : rootPage;
 }
 
-void updateAndSubscribeCurrentPage()
+/**
+ * fetch the current page in the background, which also moves the subscription to it;
+ * applyRequestedPage takes it over. With restart, a request for the page that is already running is made again
+ */
+void requestCurrentPage(boolean restart)
 {
-    DynamicJsonDocument jsonData = subscribePage(currentPage);
+    String sitemapPageId = getCurrentSitemapPageId();
+    // usually requested when the touch leading to the page went down
+    if (restart || !pagePrefetcher.pending(sitemapPageId))
+    {
+        pagePrefetcher.start(sitemapPageId, getSubscribePageUrl(sitemapPageId));
+    }
+}
 
-    if (jsonData.isNull())
+/** take over the page json of the current page, expects the page change semaphore to be taken */
+void applyCurrentPage(JsonDocument &jsonData)
+{
+    if (SITEMAP_PAGE_LOADING && currentPageIdentifier.lastIndexOf("_choices_") < 0)
     {
+        // the page response is the source of the page structure as well
+        currentPage = applyFetchedPage(currentPage, jsonData);
+        currentPageIdentifier = currentPage->identifier;
+        showCurrentPage();
         return;
     }
 
@@ -164,10 +369,27 @@ void updateAndSubscribeCurrentPage()
     for (size_t i = 0; i < widgets.size(); i++)
     {
         String widgetId = widgets[i]["widgetId"].as<String>();
-        rootPage->updateWidget(widgets[i], widgetId, currentPage, &canvas);
+        M5PanelPage::updateWidget(widgets[i], widgetId, currentPage, &canvas);
     }
+}
 
-    jsonData.clear();
+/**
+ * take over the page requested by requestCurrentPage once it was fetched, without waiting for it;
+ * expects the page change semaphore to be taken
+ */
+void applyRequestedPage()
+{
+    String sitemapPageId = getCurrentSitemapPageId();
+    if (!pagePrefetcher.finished(sitemapPageId))
+    {
+        return;
+    }
+    DynamicJsonDocument jsonData(PREFETCH_DOCUMENT_SIZE);
+    if (pagePrefetcher.take(sitemapPageId, jsonData))
+    {
+        log_d("applyRequestedPage: applying fetched page %s", sitemapPageId.c_str());
+        applyCurrentPage(jsonData);
+    }
 }
 
 bool subscribe()
@@ -181,20 +403,15 @@ bool subscribe()
 
     String subscribeResponse;
 
-    WiFiClient wifiClient;
-    HTTPClient httpClient;
-
-    httpClient.useHTTP10(true);
-    httpClient.begin(wifiClient, restUrl + "/sitemaps/events/subscribe");
-    int httpCode = httpClient.POST("");
+    int httpCode = restConnection.POST(restUrl + "/sitemaps/events/subscribe", NULL, "");
     if (httpCode != HTTP_CODE_OK)
     {
         log_d("ERROR: HTTP code %d", httpCode);
-        httpClient.end();
+        restConnection.end();
         return false;
     }
-    subscribeResponse = httpClient.getString();
-    httpClient.end();
+    subscribeResponse = restConnection.getString();
+    restConnection.end();
 
     DynamicJsonDocument subscribeResponseJson(3000);
     deserializeJson(subscribeResponseJson, subscribeResponse);
@@ -210,6 +427,7 @@ bool subscribe()
     String subscriptionURL = baseUrl.substring(baseUrl.indexOf("/rest/sitemaps"));
     String parametrizedUrl = subscriptionURL + "?sitemap=" + OPENHAB_SITEMAP + "&pageid=" + getCurrentSitemapPageId();
     log_d("subscribe: subscriptionURL: %s", parametrizedUrl.c_str());
+    subscriptionParser.reset();
     subscribeClient.connect(OPENHAB_HOST, OPENHAB_PORT);
     subscribeClient.println("GET " + parametrizedUrl + " HTTP/1.1");
     subscribeClient.println("Host: " + String(OPENHAB_HOST) + ":" + String(OPENHAB_PORT));
@@ -217,59 +435,306 @@ bool subscribe()
     subscribeClient.println(F("Connection: keep-alive"));
     subscribeClient.println();
 
-    updateAndSubscribeCurrentPage();
+    xSemaphoreTake(pageChangeSemaphore, PAGE_CHANGE_WAIT / portTICK_PERIOD_MS);
+    requestCurrentPage(true);
+    xSemaphoreGive(pageChangeSemaphore);
 
     return true;
 }
 
-void updateSiteMap()
+boolean loadSiteMap(JsonDocument &sitemap)
 {
-    jsonDoc.clear(); // jsonDoc needed to stay because elements refer to it
-    String sitemapStr;
-
 #if SAMPLE_SITEMAP
-    log_d("updateSiteMap: Load sample sitemap");
+    log_d("loadSiteMap: Load sample sitemap");
     File f = LittleFS.open("/sample_sitemap.json");
-    sitemapStr = f.readString();
+    boolean loaded = deserializeSitemapJson(f, sitemap, true);
+    f.close();
+    return loaded;
 #else
-    httpRequest(restUrl + "/sitemaps/" + OPENHAB_SITEMAP, sitemapStr);
+    return httpRequestSitemapJson(restUrl + "/sitemaps/" + OPENHAB_SITEMAP, sitemap, true);
 #endif
+}
 
-    deserializeJson(jsonDoc, sitemapStr, DeserializationOption::NestingLimit(50));
+void showCurrentPage()
+{
+    log_d("showCurrentPage: current page: %s", currentPageIdentifier.c_str());
+    currentPage = M5PanelPage::findOrBuild(rootPage, currentPageIdentifier);
+    if (currentPage == NULL)
+    {
+        // reset page because the formerly displayed page disappeared
+        currentPage = rootPage;
+        currentPageIdentifier = rootPage->identifier;
+    }
+    // the panel keeps its image, only redraw what differs from it
+    if (!currentPage->drawChanged(&canvas, panelMemoryCleared))
+    {
+        currentPage->draw(&canvas);
+    }
+    panelMemoryCleared = false;
+}
 
-    delete rootPage;
+/**
+ * build the tree from the sitemap document, which is not referenced afterwards and can be freed
+ */
+void buildSiteMap(JsonDocument &sitemap)
+{
+    // the tree of the previous generation is destroyed before its arena is released
+    M5PanelPage::destroy(rootPage);
+    treeArena.reset();
+    M5PanelPage::evictedStates.clear();
 
-    JsonObject rootPageJson = jsonDoc.as<JsonObject>()["homepage"];
+    JsonObject rootPageJson = sitemap.as<JsonObject>()["homepage"];
     rootPage = new M5PanelPage(NULL, rootPageJson);
-    log_d("updateSiteMap: current page: %s", currentPage.c_str());
-    if (currentPage == "")
+    sitemapStructureHash = hashSitemapStructure(sitemap);
+}
+
+void hideShutdownIndicators()
+{
+    touchCanvas.createCanvas(400, 15);
+    touchCanvas.fillCanvas(0);
+    touchCanvas.pushCanvas(402, 0, UPDATE_MODE_NONE);
+    refreshScheduler.refresh(402, 0, 400, 15, M5PanelContent::Binary);
+    touchCanvas.deleteCanvas();
+
+    touchCanvas.createCanvas(150, 40);
+    touchCanvas.fillCanvas(0);
+    touchCanvas.pushCanvas(0, 500, UPDATE_MODE_NONE);
+    refreshScheduler.refresh(0, 500, 150, 40, M5PanelContent::Binary);
+    touchCanvas.deleteCanvas();
+}
+
+/**
+ * build and draw the tree from the snapshot of the last wake, without network access
+ */
+boolean restoreSiteMap()
+{
+    DynamicJsonDocument snapshot(SITEMAP_DOCUMENT_SIZE);
+    if (!loadSitemapSnapshot(snapshot))
     {
-        currentPage = rootPage->identifier;
+        return false;
     }
+    log_d("restoreSiteMap: restored sitemap snapshot");
+    buildSiteMap(snapshot);
+    // states are restored into built pages only
+    M5PanelPage::findOrBuild(rootPage, currentPageIdentifier);
+    loadWidgetStates();
+    showCurrentPage();
+    hideShutdownIndicators();
+    return true;
+}
 
-    if (!rootPage->draw(currentPage, &canvas))
+/** update the built widgets, and the sources of the pages below them that are not built */
+void applySiteMapStates(JsonObject page)
+{
+    JsonArray widgets = page["widgets"];
+    for (JsonObject widget : widgets)
     {
-        // reset page because the formerly displayed page disappeared
-        currentPage = rootPage->identifier;
-        rootPage->draw(&canvas);
+        if (!widget["widgetId"].isNull())
+        {
+            String widgetId = widget["widgetId"].as<String>();
+            M5PanelPage::updateWidget(widget, widgetId, currentPage, &canvas);
+            auto indexed = M5PanelPage::widgetIndex.find(widgetId);
+            if (indexed != M5PanelPage::widgetIndex.end() && indexed->second.element->updateDetailSource(widget))
+            {
+                // the source covers the widgets below
+                continue;
+            }
+        }
+        applySiteMapStates(widget);
+        if (!widget["linkedPage"].isNull())
+        {
+            applySiteMapStates(widget["linkedPage"]);
+        }
+    }
+}
+
+/**
+ * page loading: only the root page is fetched here, and only when the cached one is stale;
+ * the other pages are fetched when they are shown or prefetched
+ */
+void updateRootPage()
+{
+    if (rootPage != NULL && cachedPageAge(OPENHAB_SITEMAP) < PAGE_CACHE_MAX_AGE)
+    {
+        log_d("updateRootPage: root page is fresh");
+        return;
+    }
+
+    DynamicJsonDocument page(SITEMAP_DOCUMENT_SIZE);
+    if (!httpRequestSitemapJson(restUrl + "/sitemaps/" + OPENHAB_SITEMAP + "/" + OPENHAB_SITEMAP, page, false))
+    {
+        if (rootPage != NULL)
+        {
+            log_d("updateRootPage: could not load root page, keeping current one");
+            return;
+        }
+        // a stale cached root page is better than none
+        page.clear();
+        if (!loadCachedPage(OPENHAB_SITEMAP, page))
+        {
+            log_d("updateRootPage: could not load root page, nothing cached");
+            return;
+        }
+        log_d("updateRootPage: could not load root page, using cached one");
+        DynamicJsonDocument sitemap = rootPageSitemap(page);
+        buildSiteMap(sitemap);
+        showCurrentPage();
+        return;
+    }
+
+    if (rootPage == NULL)
+    {
+        saveCachedPage(OPENHAB_SITEMAP, page);
+        DynamicJsonDocument sitemap = rootPageSitemap(page);
+        saveSitemapSnapshot(sitemap);
+        buildSiteMap(sitemap);
+    }
+    else
+    {
+        applyFetchedPage(rootPage, page);
+    }
+    showCurrentPage();
+}
+
+unsigned long linkedPageRetryMillis = 0;
+
+/**
+ * page loading: id of a page linked from the current page that has no content yet or is stale in the page cache,
+ * "" if there is none; expects the page change semaphore to be taken
+ */
+String findStaleLinkedPage()
+{
+    if (!SITEMAP_PAGE_LOADING || SAMPLE_SITEMAP || currentPage == NULL || millis() < linkedPageRetryMillis)
+    {
+        return "";
+    }
+
+    for (M5PanelUIElement *element : currentPage->elements)
+    {
+        if (element == NULL || !element->hasDetail())
+        {
+            continue;
+        }
+        M5PanelPage *detail = element->getDetail();
+        if (detail == NULL)
+        {
+            continue;
+        }
+        String pageId = getSitemapPageId(detail->identifier);
+        uint32_t age = cachedPageAge(pageId);
+        // frames come with their parent page and are not cached on their own
+        if (detail->hasContent && (age < PAGE_CACHE_MAX_AGE || age == UINT32_MAX))
+        {
+            continue;
+        }
+        return pageId;
     }
+    return "";
 }
 
-void parseSubscriptionData(String jsonDataStr)
+/**
+ * page loading: fetch a linked page found by findStaleLinkedPage, so that it is prerendered with content;
+ * the page change semaphore is taken only for applying it, not while waiting for the response
+ */
+void prefetchLinkedPage(String pageId)
 {
-    DynamicJsonDocument jsonData(60000);
-    deserializeJson(jsonData, jsonDataStr, DeserializationOption::NestingLimit(50));
-    log_d("parseSubscriptionData: %s", jsonDataStr.c_str());
+    log_d("prefetchLinkedPage: fetching %s", pageId.c_str());
+    DynamicJsonDocument page(SITEMAP_DOCUMENT_SIZE);
+    if (!httpRequestSitemapJson(restUrl + "/sitemaps/" + OPENHAB_SITEMAP + "/" + pageId, page, false))
+    {
+        linkedPageRetryMillis = millis() + PAGE_PREFETCH_RETRY;
+        return;
+    }
+
+    xSemaphoreTake(pageChangeSemaphore, PAGE_CHANGE_WAIT / portTICK_PERIOD_MS);
+    // the tree may have changed during the request
+    M5PanelPage *linked = M5PanelPage::find(pageId + "_0");
+    if (linked != NULL)
+    {
+        applyFetchedPage(linked, page);
+        // the page may have been navigated to in the meantime, or replaced together with the current page
+        showCurrentPage();
+    }
+    xSemaphoreGive(pageChangeSemaphore);
+}
+
+void updateSiteMap()
+{
+    if (SITEMAP_PAGE_LOADING && !SAMPLE_SITEMAP)
+    {
+        updateRootPage();
+        return;
+    }
+
+    DynamicJsonDocument sitemap(SITEMAP_DOCUMENT_SIZE);
+    if (!loadSiteMap(sitemap))
+    {
+        log_d("updateSiteMap: could not load sitemap, keeping current one");
+        if (rootPage == NULL)
+        {
+            buildSiteMap(sitemap);
+            showCurrentPage();
+        }
+        return;
+    }
+
+    if (rootPage == NULL)
+    {
+        saveSitemapSnapshot(sitemap);
+        buildSiteMap(sitemap);
+        showCurrentPage();
+        return;
+    }
+
+    // revalidate the existing tree against the current sitemap
+    if (hashSitemapStructure(sitemap) == sitemapStructureHash)
+    {
+        log_d("updateSiteMap: sitemap structure unchanged, updating states");
+        // pages not built yet are built from the snapshot after the next wake
+        saveSitemapSnapshot(sitemap);
+        applySiteMapStates(sitemap["homepage"]);
+        return;
+    }
+
+    saveSitemapSnapshot(sitemap);
+    // reconciling leaves replaced parts in the arena, rebuild to compact it once they dominate
+    if (!treeArena.fragmented() && rootPage->reconcile(sitemap["homepage"]))
+    {
+        log_d("updateSiteMap: sitemap structure changed, kept unchanged pages");
+        sitemapStructureHash = hashSitemapStructure(sitemap);
+        showCurrentPage();
+        return;
+    }
+
+    log_d("updateSiteMap: sitemap structure changed, rebuilding");
+    buildSiteMap(sitemap);
+    showCurrentPage();
+}
+
+void parseSubscriptionData(const char *jsonDataStr, size_t length, unsigned long receivedMillis)
+{
+    JsonDocument &jsonData = subscriptionEventJson;
+    DeserializationError error = deserializeJson(jsonData, jsonDataStr, length, DeserializationOption::NestingLimit(50));
+    log_d("parseSubscriptionData: %.*s", (int)length, jsonDataStr);
+    if (error)
+    {
+        log_d("parseSubscriptionData: %s", error.c_str());
+        jsonData.clear();
+        return;
+    }
     if (!jsonData["widgetId"].isNull()) // Data Widget (subscription)
     {
         String widgetId = jsonData["widgetId"];
         log_d("parseSubscriptionData: Widget changed: %s", widgetId.c_str());
+        latency.startEvent(receivedMillis);
+        latency.echoReceived(widgetId);
 
         xSemaphoreTake(pageChangeSemaphore, PAGE_CHANGE_WAIT / portTICK_PERIOD_MS);
         // CRITICAL SECTION PAGE UPDATE
 
         // update widget and redraw if widget on currently shown page
-        rootPage->updateWidget(jsonData.as<JsonObject>(), widgetId, currentPage, &canvas);
+        M5PanelPage::updateWidget(jsonData.as<JsonObject>(), widgetId, currentPage, &canvas);
+        latency.finishEvent();
 
         // CRITICAL SECTION PAGE UPDATE END
         xSemaphoreGive(pageChangeSemaphore);
@@ -287,8 +752,12 @@ void parseSubscriptionData(String jsonDataStr)
             // CRITICAL SECTION PAGE UPDATE
 
             log_d("parseSubscriptionData: Sitemap changed, reloading");
+            if (SITEMAP_PAGE_LOADING)
+            {
+                clearPageCache();
+            }
             updateSiteMap();
-            updateAndSubscribeCurrentPage();
+            requestCurrentPage(true);
 
             // CRITICAL SECTION PAGE UPDATE END
             xSemaphoreGive(pageChangeSemaphore);
@@ -344,13 +813,28 @@ void syncRTC()
     */
 }
 
+void readRenderedContent()
+{
+    if (LittleFS.exists(RENDERED_CONTENT_FILE))
+    {
+        File renderedContent = LittleFS.open(RENDERED_CONTENT_FILE);
+        if (renderedContent.read((uint8_t *)&M5PanelPage::renderedContent, sizeof(M5PanelRenderedContent)) != sizeof(M5PanelRenderedContent))
+        {
+            M5PanelPage::renderedContent = {};
+        }
+        renderedContent.close();
+    }
+}
+
 boolean readSavedState()
 {
+    readRenderedContent();
+
     if (LittleFS.exists(SAVED_STATE_FILE))
     {
         File savedState = LittleFS.open(SAVED_STATE_FILE);
-        currentPage = savedState.readString();
-        log_d("readSavedState: read current page from saved file: %s", currentPage.c_str());
+        currentPageIdentifier = savedState.readString();
+        log_d("readSavedState: read current page from saved file: %s", currentPageIdentifier.c_str());
         savedState.close();
         return true;
     }
@@ -360,82 +844,152 @@ boolean readSavedState()
     }
 }
 
+void onSubscriptionEvent(const char *event, const char *data, size_t length)
+{
+    // parsing is part of the update latency
+    parseSubscriptionData(data, length, millis());
+}
+
 void checkSubscription()
 {
     // Subscribe or re-subscribe to sitemap
-    if (!subscribeClient.connected())
+    if (!subscribeClient.connected() || subscriptionParser.finished())
     {
         log_d("subscribeClient not connected, connecting...");
+        subscribeClient.stop();
         if (!subscribe())
         {
             delay(300);
         }
     }
 
-    // Check and get subscription data
-    while (subscribeClient.available())
+    // Check and get subscription data, complete events are passed to parseSubscriptionData
+    subscriptionParser.process(subscribeClient);
+}
+
+/** make newPage the current page, expects the page change semaphore to be taken */
+void changePage(M5PanelPage *newPage)
+{
+    int oldPageChoicesIdx = currentPageIdentifier.lastIndexOf("_choices_");
+    int newPageChoicesIdx = newPage->identifier.lastIndexOf("_choices_");
+
+    boolean fetch = oldPageChoicesIdx < 0 && newPageChoicesIdx < 0; // no subscription update if navigating from / to choices
+
+    currentPage = newPage;
+    currentPageIdentifier = newPage->identifier;
+    log_d("changePage: new current page after touch: %s", currentPageIdentifier.c_str());
+    // show the page with the states known so far, usually prerendered, even if its widgets are not known yet
+    newPage->draw(&touchCanvas);
+    latency.recordTouch(M5PanelLatencyProbe::ReleaseToPage);
+    if (fetch)
+    {
+        // taken over right away if the prefetch finished, else by the update loop once it did
+        requestCurrentPage(false);
+        applyRequestedPage();
+    }
+    else
+    {
+        log_d("no re-fetch of page due to navigation from / to choices");
+    }
+}
+
+/**
+ * start fetching the page a touch pressed at (x, y) navigates to, while the finger is still down;
+ * changePage takes the result through applyRequestedPage
+ */
+void prefetchNavigationTarget(uint16_t x, uint16_t y)
+{
+    if (SAMPLE_SITEMAP)
     {
-        String subscriptionReceivedData = subscribeClient.readStringUntil('\n');
-        int dataStart = subscriptionReceivedData.indexOf("data: ");
-        if (dataStart > -1) // received data contains "data: "
-        {
-            String subscriptionData = subscriptionReceivedData.substring(dataStart + 6); // Remove chars before "data: "
-            int dataEnd = subscriptionData.indexOf("\n\n");
-            subscriptionData = subscriptionData.substring(0, dataEnd);
-            parseSubscriptionData(subscriptionData);
-        }
+        return;
+    }
+    M5PanelPage *target = currentPage->getNavigationTarget(x, y);
+    // like changePage, pages are not fetched when navigating from / to choices
+    if (target == NULL || currentPageIdentifier.lastIndexOf("_choices_") >= 0 || target->identifier.lastIndexOf("_choices_") >= 0)
+    {
+        return;
     }
+    String sitemapPageId = getSitemapPageId(target->identifier);
+    pagePrefetcher.start(sitemapPageId, getSubscribePageUrl(sitemapPageId));
 }
 
-void checkTouch()
+/** wait for the next gesture and react to it, waiting at most wait ms */
+void checkTouch(unsigned long wait)
 {
-    if (M5.TP.avaliable())
+    M5PanelGesture gesture = touch.nextGesture(wait);
+    if (gesture.type == M5PanelGestureType::None)
     {
-        M5.TP.update();
-        bool is_finger_up = M5.TP.isFingerUp();
-        if (is_finger_up)
-        {
-            if (_last_pos_x != 0xFFFF && _last_pos_y != 0xFFFF)
-            {
-                // user interaction detected
-                log_d("checkTouch: resetting interactionStartMillis");
-                interactionStartMillis = loopStartMillis;
-
-                // process touch on finger lifting
-                M5PanelPage *newPage = rootPage->processTouch(currentPage, _last_pos_x, _last_pos_y, &touchCanvas);
-                if (currentPage != newPage->identifier)
-                {
-                    xSemaphoreTake(pageChangeSemaphore, PAGE_CHANGE_WAIT / portTICK_PERIOD_MS);
-                    // CRITICAL SECTION OF PAGE CHANGE
-
-                    int oldPageChoicesIdx = currentPage.lastIndexOf("_choices_");
-                    int newPageChoicesIdx = newPage->identifier.lastIndexOf("_choices_");
-
-                    currentPage = newPage->identifier;
-                    log_d("checkTouch: new current page after touch: %s", currentPage.c_str());
-                    if (oldPageChoicesIdx < 0 && newPageChoicesIdx < 0) // no subscription update if navigating from / to choices
-                    {
-                        updateAndSubscribePage(newPage);
-                    }
-                    else
-                    {
-                        log_d("no re-fetch of page due to navigation from / to choices");
-                    }
-                    newPage->draw(&touchCanvas);
-
-                    // CRITICAL SECTION OF PAGE CHANGE END
-                    xSemaphoreGive(pageChangeSemaphore);
-                }
-                _last_pos_x = _last_pos_y = 0xFFFF;
-            }
-        }
-        else
+        return;
+    }
+
+    // user interaction detected
+    log_d("checkTouch: resetting interactionStartMillis");
+    interactionStartMillis = millis();
+    latency.startTouch(gesture.millis);
+    latency.recordTouch(M5PanelLatencyProbe::TouchToGesture);
+
+    // pages behind the touched element may be built
+    boolean press = gesture.type == M5PanelGestureType::Press;
+    if (xSemaphoreTake(pageChangeSemaphore, (press ? PRESS_HIGHLIGHT_WAIT : PAGE_CHANGE_WAIT) / portTICK_PERIOD_MS) != pdTRUE)
+    {
+        // behind a running prerender step the highlight would come late and hold up the finger up;
+        // other gestures are dropped rather than changing the page next to its holder
+        log_d("checkTouch: page busy, dropping gesture");
+        return;
+    }
+    M5PanelPage *newPage = currentPage;
+    boolean swipe = false;
+    switch (gesture.type)
+    {
+    case M5PanelGestureType::Press:
+        // highlight right away, the action follows when the finger is lifted
+        if (currentPage->pressTouch(gesture.x, gesture.y, &touchCanvas))
         {
-            _last_pos_x = M5.TP.readFingerX(0);
-            _last_pos_y = M5.TP.readFingerY(0);
+            latency.recordTouch(M5PanelLatencyProbe::TouchToHighlight);
+            prefetchNavigationTarget(gesture.x, gesture.y);
         }
-        M5.TP.flush();
+        break;
+    case M5PanelGestureType::Tap:
+        newPage = currentPage->releaseTouch(gesture.x, gesture.y, gesture.releaseX, gesture.releaseY, &touchCanvas);
+        latency.recordTouch(M5PanelLatencyProbe::ReleaseToAction);
+        break;
+    case M5PanelGestureType::LongPress:
+        // committed while the finger is still down, lifting it does nothing more
+        newPage = currentPage->processTouch(gesture.x, gesture.y, &touchCanvas);
+        latency.recordTouch(M5PanelLatencyProbe::ReleaseToAction);
+        break;
+    case M5PanelGestureType::SwipeLeft:
+    case M5PanelGestureType::SwipeUp:
+        // swiping works anywhere on the panel, like the arrows of the navigation column
+        newPage = currentPage->next != NULL ? currentPage->next : currentPage;
+        swipe = true;
+        break;
+    case M5PanelGestureType::SwipeRight:
+    case M5PanelGestureType::SwipeDown:
+        newPage = currentPage->previous != NULL ? currentPage->previous : currentPage;
+        swipe = true;
+        break;
+    default:
+        break;
+    }
+    if (swipe && newPage == currentPage)
+    {
+        // a swipe started as a press on whatever was below the finger
+        currentPage->cancelTouch(gesture.x, gesture.y, &touchCanvas);
+    }
+    // a prefetch for another page than the one shown next is outdated
+    if (gesture.type != M5PanelGestureType::Press && pagePrefetcher.discard(getSitemapPageId(newPage->identifier)) && currentPage == newPage)
+    {
+        // the touch was cancelled, but its prefetch moved the subscription
+        pagePrefetcher.start(getCurrentSitemapPageId(), getSubscribePageUrl(getCurrentSitemapPageId()), false);
+    }
+    if (currentPage != newPage)
+    {
+        // CRITICAL SECTION OF PAGE CHANGE
+        changePage(newPage);
+        // CRITICAL SECTION OF PAGE CHANGE END
     }
+    xSemaphoreGive(pageChangeSemaphore);
 }
 
 void showWakeUpIndicator()
@@ -444,26 +998,20 @@ void showWakeUpIndicator()
 
     touchCanvas.fillCircle(100, -23, 40, 15);
 
-    touchCanvas.setTextSize(FONT_SIZE_LABEL);
-    touchCanvas.setTextDatum(TC_DATUM);
-    touchCanvas.setTextColor(0);
-    touchCanvas.drawString("^", 100, 0);
+    glyphCache.drawString(&touchCanvas, "^", FONT_SIZE_LABEL, TC_DATUM, 100, 0, 0);
+    glyphCache.drawString(&touchCanvas, "3s drücken", FONT_SIZE_LABEL_SMALL, TC_DATUM, 200, 0);
 
-    touchCanvas.setTextSize(FONT_SIZE_LABEL_SMALL);
-    touchCanvas.setTextColor(15);
-    touchCanvas.drawString("3s drücken", 200, 0);
-
-    touchCanvas.pushCanvas(402, 0, UPDATE_MODE_GLD16);
+    touchCanvas.pushCanvas(402, 0, UPDATE_MODE_NONE);
+    refreshScheduler.refresh(402, 0, 400, 15, M5PanelContent::Grayscale);
     touchCanvas.deleteCanvas();
 }
 
 void showSleepText()
 {
     touchCanvas.createCanvas(150, 30);
-    touchCanvas.setTextSize(FONT_SIZE_LABEL);
-    touchCanvas.setTextDatum(TL_DATUM);
-    touchCanvas.drawString("ZzzZzz", 40, 0);
-    touchCanvas.pushCanvas(0, 70, UPDATE_MODE_DU);
+    glyphCache.drawString(&touchCanvas, "ZzzZzz", FONT_SIZE_LABEL, TL_DATUM, 40, 0);
+    touchCanvas.pushCanvas(0, 70, UPDATE_MODE_NONE);
+    refreshScheduler.refresh(0, 70, 150, 30, M5PanelContent::Binary);
     touchCanvas.deleteCanvas();
 }
 
@@ -479,9 +1027,28 @@ void shutdown()
     // showSleepText();
 
     File savedState = LittleFS.open(SAVED_STATE_FILE, "w", true);
-    savedState.print(currentPage.c_str());
+    savedState.print(currentPageIdentifier.c_str());
     savedState.close();
 
+    // let the commands of the last touches go out, the journal keeps the others for the next wake
+    unsigned long commandWaitStart = millis();
+    while (!commandQueue.idle() && millis() - commandWaitStart < COMMAND_SHUTDOWN_WAIT)
+    {
+        delay(50);
+    }
+    commandQueue.persist();
+
+    // keep the latest states for drawing the restored page on wake
+    xSemaphoreTake(pageChangeSemaphore, PAGE_CHANGE_WAIT / portTICK_PERIOD_MS);
+    saveWidgetStates();
+    File renderedContent = LittleFS.open(RENDERED_CONTENT_FILE, "w", true);
+    renderedContent.write((uint8_t *)&M5PanelPage::renderedContent, sizeof(M5PanelRenderedContent));
+    renderedContent.close();
+    xSemaphoreGive(pageChangeSemaphore);
+
+    latency.dump(Serial);
+    latency.save();
+
     delay(1000);
 
     // shut down M5 to save energy
@@ -490,7 +1057,7 @@ void shutdown()
     M5.disableEPDPower();
     M5.disableEXTPower();
     M5.disableMainPower();
-    esp_sleep_enable_ext0_wakeup(GPIO_NUM_36, LOW); // TOUCH_INT
+    esp_sleep_enable_ext0_wakeup(TOUCH_INT_PIN, LOW);
     esp_sleep_enable_timer_wakeup(REFRESH_INTERVAL * 1000000);
     esp_deep_sleep_start();
     while (1)
@@ -509,9 +1076,57 @@ void updateLoop(void *pvParameters)
             checkSubscription();
         }
 
+        String stalePageId = "";
+        xSemaphoreTake(pageChangeSemaphore, PAGE_CHANGE_WAIT / portTICK_PERIOD_MS);
+        applyRequestedPage();
+        M5PanelCommandResult result;
+        while (commandQueue.nextResult(&result))
+        {
+            if (!result.sent)
+            {
+                // the state did not change, take back the highlight or pending value of the touch
+                M5PanelPage::rollbackWidget(result.widgetId, currentPage, &canvas);
+            }
+        }
+        if (!refreshScheduler.flush() && !refreshScheduler.cleanup() && !refreshScheduler.pending())
+        {
+            if (ESP.getFreeHeap() < PAGE_EVICTION_FREE_HEAP || ESP.getFreePsram() < PAGE_EVICTION_FREE_PSRAM)
+            {
+                log_d("updateLoop: low on memory, evicting pages");
+                M5PanelPage::evictPages(rootPage, currentPage);
+            }
+            // idle: fetch and render the pages that can be navigated to next
+            stalePageId = findStaleLinkedPage();
+            if (stalePageId == "")
+            {
+                prerenderer.step(currentPage, &canvas);
+            }
+        }
+        xSemaphoreGive(pageChangeSemaphore);
+
+        if (stalePageId != "")
+        {
+            prefetchLinkedPage(stalePageId);
+        }
+
         events(); // for ezTime
 
-        vTaskDelay(200 / portTICK_PERIOD_MS);
+        // 'l' dumps the latency histograms, 'r' starts them over
+        while (Serial.available() > 0)
+        {
+            int key = Serial.read();
+            if (key == 'l')
+            {
+                latency.dump(Serial);
+            }
+            else if (key == 'r')
+            {
+                latency.reset();
+            }
+        }
+
+        // poll faster while widget updates wait for their refresh
+        vTaskDelay((refreshScheduler.pending() ? 20 : 200) / portTICK_PERIOD_MS);
     }
 }
 
@@ -519,19 +1134,16 @@ void interactionLoop(void *pvParameters)
 {
     while (true)
     {
-        loopStartMillis = millis();
+        // blocks until the touch controller reports a finger, the sleep timeout is checked in between
+        checkTouch(INTERACTION_SLEEP_CHECK);
 
-        checkTouch();
-
-        unsigned long durationSinceInteraction = loopStartMillis - interactionStartMillis;
+        unsigned long durationSinceInteraction = millis() - interactionStartMillis;
 
         if (durationSinceInteraction > (TIME_UNTIL_SLEEP * 1000))
         {
             log_d("interactionLoop: Shutting down after %d ms since interaction", durationSinceInteraction);
             shutdown();
         }
-
-        vTaskDelay(50 / portTICK_PERIOD_MS);
     }
 }
 
@@ -550,9 +1162,11 @@ void setup()
     M5.begin(true, false, true, false, false); // bool touchEnable = true, bool SDEnable = false, bool SerialEnable = true, bool BatteryADCEnable = false, bool I2CEnable = false
     gpio_deep_sleep_hold_dis();
     M5.disableEXTPower();
+    touch.begin();
 
     // M5.EPD.SetRotation(180);
     M5.EPD.Clear(false);
+    panelMemoryCleared = true;
     M5.RTC.begin();
 
     // FS Setup
@@ -570,6 +1184,7 @@ void setup()
     if (LittleFS.begin())
     {
         log_d("LittleFS mounted correctly.");
+        latency.load();
     }
     else
     {
@@ -588,23 +1203,35 @@ void setup()
 
     log_d("Total space used: %d byte", usedBytes);
 
-    esp_err_t errorCode = canvas.loadFont("/FreeSansBold.ttf", LittleFS);
-    touchCanvas.loadFont("/FreeSansBold.ttf", LittleFS);
     // TODO : Should fail and stop if font not found
-    log_d("Font load exit code: %d", errorCode);
+    if (!LittleFS.exists(FONT_FILE))
+    {
+        log_d("!Font %s not found", FONT_FILE);
+    }
 
-    canvas.createRender(FONT_SIZE_LABEL, FONT_CACHE_SIZE);
-    canvas.createRender(FONT_SIZE_LABEL_SMALL, FONT_CACHE_SIZE);
-    canvas.createRender(FONT_SIZE_CONTROL, FONT_CACHE_SIZE);
+    // glyphs rasterized before, the font itself is only loaded for glyphs not seen yet
+    glyphCache.begin();
 
-    touchCanvas.createRender(FONT_SIZE_LABEL, FONT_CACHE_SIZE);
-    touchCanvas.createRender(FONT_SIZE_LABEL_SMALL, FONT_CACHE_SIZE);
+    if (!iconAtlas.begin(ICON_SIZE, ICON_SIZE))
+    {
+        log_d("Icon atlas not available, icons are decoded from LittleFS");
+    }
 
-    canvas.setTextSize(FONT_SIZE_LABEL);
+    // touches queue their commands, they are sent once the network is up
+    commandQueue.begin();
+    pagePrefetcher.begin(&fetchPage);
 
     // read and remove saved state
     readSavedState();
 
+    // show the page of the last wake while the network comes up
+    boolean restored = restoreSiteMap();
+    if (restored)
+    {
+        xTaskCreatePinnedToCore(interactionLoop, "interactionLoop", 4096, NULL, 2,
+                                NULL, 1);
+    }
+
     // Setup Wifi
     if (!SAMPLE_SITEMAP)
     {
@@ -624,15 +1251,20 @@ void setup()
         setTimeZone();
     }
 
+    xSemaphoreTake(pageChangeSemaphore, PAGE_CHANGE_WAIT / portTICK_PERIOD_MS);
     updateSiteMap();
+    xSemaphoreGive(pageChangeSemaphore);
 
     if (!SAMPLE_SITEMAP)
     {
         subscribe();
     }
 
-    xTaskCreatePinnedToCore(interactionLoop, "interactionLoop", 4096, NULL, 2,
-                            NULL, 1);
+    if (!restored)
+    {
+        xTaskCreatePinnedToCore(interactionLoop, "interactionLoop", 4096, NULL, 2,
+                                NULL, 1);
+    }
 
     xTaskCreatePinnedToCore(updateLoop, "updateLoop", 4096, NULL, 1,
                             NULL, 0);
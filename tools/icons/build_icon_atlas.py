@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""Pack the icons listed in png_icons.csv into one 4bpp atlas for the icons partition.
+
+Layout (little endian):
+    header   magic "M5IA", uint16 version, uint16 count, uint16 width, uint16 height, uint32 reserved
+    table    count entries of char name[40] (zero padded), uint32 offset (from start of atlas), sorted by name
+    bitmaps  width * height / 2 bytes each, two pixels per byte (left pixel in the high nibble),
+             0 is white and 15 is black, like the M5EPD canvas
+
+Usage: build_icon_atlas.py [output]   (default: icons.bin, run from tools/icons)
+"""
+import struct
+import sys
+import zlib
+
+ICON_SIZE = 96
+NAME_LENGTH = 40
+VERSION = 1
+
+pngdir = "png"
+csvfile = "png_icons.csv"
+
+
+def read_png(path):
+    """Decode a non-interlaced 8 bit PNG into rows of (gray, alpha) tuples."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:8] != b"\x89PNG\r\n\x1a\n":
+        raise ValueError(path + " is not a PNG file")
+
+    pos = 8
+    idat = b""
+    while pos < len(data):
+        length, chunk = struct.unpack(">I4s", data[pos:pos + 8])
+        body = data[pos + 8:pos + 8 + length]
+        if chunk == b"IHDR":
+            width, height, depth, color, _, _, interlace = struct.unpack(">IIBBBBB", body)
+        elif chunk == b"IDAT":
+            idat += body
+        pos += length + 12
+
+    channels = {0: 1, 2: 3, 4: 2, 6: 4}.get(color)
+    if depth != 8 or channels is None or interlace != 0:
+        raise ValueError(path + ": only non-interlaced 8 bit gray / RGB(A) images are supported")
+
+    raw = zlib.decompress(idat)
+    stride = width * channels
+    rows = []
+    previous = bytearray(stride)
+    for y in range(height):
+        start = y * (stride + 1)
+        filter_type = raw[start]
+        row = bytearray(raw[start + 1:start + 1 + stride])
+        for i in range(stride):
+            left = row[i - channels] if i >= channels else 0
+            up = previous[i]
+            up_left = previous[i - channels] if i >= channels else 0
+            if filter_type == 1:
+                row[i] = (row[i] + left) & 0xFF
+            elif filter_type == 2:
+                row[i] = (row[i] + up) & 0xFF
+            elif filter_type == 3:
+                row[i] = (row[i] + ((left + up) >> 1)) & 0xFF
+            elif filter_type == 4:
+                p = left + up - up_left
+                pa, pb, pc = abs(p - left), abs(p - up), abs(p - up_left)
+                predictor = left if pa <= pb and pa <= pc else (up if pb <= pc else up_left)
+                row[i] = (row[i] + predictor) & 0xFF
+        previous = row
+
+        pixels = []
+        for x in range(width):
+            px = row[x * channels:(x + 1) * channels]
+            if channels in (1, 2):
+                gray = px[0]
+            else:
+                gray = (px[0] * 299 + px[1] * 587 + px[2] * 114) // 1000
+            alpha = px[-1] if channels in (2, 4) else 255
+            pixels.append((gray, alpha))
+        rows.append(pixels)
+    return width, height, rows
+
+
+def to_4bpp(width, height, rows):
+    """Composite on white, dither to 16 levels (Floyd-Steinberg) and pack two pixels per byte."""
+    # darkness 0.0 (white) .. 15.0 (black)
+    darkness = [[(255 - (gray * alpha + 255 * (255 - alpha)) / 255) * 15 / 255 for gray, alpha in row] for row in rows]
+    levels = [[0] * width for _ in range(height)]
+    for y in range(height):
+        for x in range(width):
+            value = darkness[y][x]
+            level = min(15, max(0, int(round(value))))
+            levels[y][x] = level
+            error = value - level
+            if x + 1 < width:
+                darkness[y][x + 1] += error * 7 / 16
+            if y + 1 < height:
+                if x > 0:
+                    darkness[y + 1][x - 1] += error * 3 / 16
+                darkness[y + 1][x] += error * 5 / 16
+                if x + 1 < width:
+                    darkness[y + 1][x + 1] += error * 1 / 16
+
+    packed = bytearray()
+    for y in range(height):
+        for x in range(0, width, 2):
+            packed.append((levels[y][x] << 4) | levels[y][x + 1])
+    return bytes(packed)
+
+
+def main():
+    output = sys.argv[1] if len(sys.argv) > 1 else "icons.bin"
+
+    names = []
+    with open(csvfile) as f:
+        for line in f:
+            line = line.strip()
+            if line:
+                names.append(line.split(";")[1].lower())
+    names = sorted(set(names))
+
+    header_size = 16
+    table_size = len(names) * (NAME_LENGTH + 4)
+    bitmap_size = ICON_SIZE * ICON_SIZE // 2
+
+    table = bytearray()
+    bitmaps = bytearray()
+    for index, name in enumerate(names):
+        width, height, rows = read_png("%s/%s.png" % (pngdir, name))
+        if (width, height) != (ICON_SIZE, ICON_SIZE):
+            raise ValueError("%s: icon must be %dx%d" % (name, ICON_SIZE, ICON_SIZE))
+        encoded = name.encode()
+        if len(encoded) >= NAME_LENGTH:
+            raise ValueError(name + ": name too long")
+        offset = header_size + table_size + index * bitmap_size
+        table += encoded.ljust(NAME_LENGTH, b"\0") + struct.pack("<I", offset)
+        bitmaps += to_4bpp(width, height, rows)
+        print("%s -> %d" % (name, offset))
+
+    header = b"M5IA" + struct.pack("<HHHHI", VERSION, len(names), ICON_SIZE, ICON_SIZE, 0)
+    with open(output, "wb") as f:
+        f.write(header + table + bitmaps)
+    print("%d icons, %d bytes written to %s" % (len(names), header_size + table_size + len(bitmaps), output))
+
+
+if __name__ == "__main__":
+    main()